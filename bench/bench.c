@@ -0,0 +1,68 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench/bench.h"
+#include "dns.h"
+#include "lookup.h"
+#include "stralloc.h"
+
+static char dir[] = "/tmp/microdns.XXXXXX";
+
+static void cleanup(void) {
+  if (chdir(dir) == 0)
+    unlink("data.cdb");
+  rmdir(dir);
+}
+
+FILE *bench_data(void) {
+  char command[64];
+  FILE *data;
+
+  if (access("dnsdata", X_OK) < 0)
+    err(1, "dnsdata");
+  if (!mkdtemp(dir))
+    err(1, "mkdtemp");
+  atexit(cleanup);
+
+  snprintf(command, sizeof command, "exec ./dnsdata -d %s", dir);
+  if (!(data = popen(command, "w")))
+    err(1, "popen");
+  return data;
+}
+
+void bench_load(FILE *data, struct lookup_ctx *ctx) {
+  int status = pclose(data);
+
+  if (status < 0)
+    err(1, "pclose");
+  if (!WIFEXITED(status) || WEXITSTATUS(status))
+    errx(1, "dnsdata failed");
+  if (chdir(dir) < 0)
+    err(1, "chdir");
+  if (!lookup_ctx_init(ctx, "data.cdb"))
+    err(1, "data.cdb");
+}
+
+void bench_query(stralloc *packet, const char *name, const char type[2]) {
+  static stralloc dn;
+
+  if (!dns_domain_fromdot(&dn, name, strlen(name)))
+    errx(1, "Invalid domain name: %s", name);
+  if (!stralloc_copyb(packet, "\0\0\0\0\0\1\0\0\0\0\0\0", 12)
+      || !stralloc_catb(packet, dn.s, dn.len)
+      || !stralloc_catb(packet, type, 2)
+      || !stralloc_catb(packet, DNS_C_IN, 2))
+    err(1, "malloc");
+}
+
+double bench_time(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
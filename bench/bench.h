@@ -0,0 +1,21 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include "lookup.h"
+#include "stralloc.h"
+
+/* Benchmarks run from the top of the tree after make. bench_data() returns
+   a stream for data lines, which bench_load() passes through dnsdata into
+   a temporary data.cdb before opening it with ctx. */
+
+FILE *bench_data(void);
+void bench_load(FILE *data, struct lookup_ctx *ctx);
+
+/* bench_query() replaces packet with a query for the dotted name. */
+
+void bench_query(stralloc *packet, const char *name, const char type[2]);
+double bench_time(void);
+
+#endif
@@ -0,0 +1,68 @@
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench/bench.h"
+#include "dns.h"
+#include "lookup.h"
+#include "stralloc.h"
+
+/* Answer uncached queries for random names, drawn from the first 1000
+   names and then from ever larger parts of a database of four million.
+   Batches of 32 alternate between being answered one query at a time,
+   which never prefetches, and together as udpdns does, where the cdb
+   lookups of each group are prefetched in turn. Only a database far
+   larger than the CPU caches gives the prefetches misses to overlap. */
+
+#define BATCH 32
+#define CHUNK 64 /* batches answered each way in turn */
+
+int main(int argc, char **argv) {
+  static struct lookup_query q[BATCH];
+  struct lookup_ctx ctx = { 0 };
+  long names = argc > 1 ? atol(argv[1]) : 4000000;
+  long queries = argc > 2 ? atol(argv[2]) : 1000000;
+  char ip[4] = { 127, 0, 0, 1 }, name[64];
+  FILE *data = bench_data();
+
+  fprintf(data, ".example.com:ns.example.com\n");
+  for (long i = 0; i < names; i++)
+    fprintf(data, "+h%ld.example.com:10.%ld.%ld.%ld\n", i, i >> 16 & 255,
+      i >> 8 & 255, i & 255);
+  bench_load(data, &ctx);
+
+  printf("names     one at a time  batched  speedup\n");
+  for (long range = 1000; range <= names; range *= 8) {
+    double elapsed[2] = { 0 };
+
+    srandom(1);
+    for (long n = 0; n < 2 * queries; n += BATCH) {
+      int batched = n / BATCH / CHUNK % 2;
+      double start;
+
+      for (int i = 0; i < BATCH; i++) {
+        snprintf(name, sizeof name, "h%ld.example.com", random() % range);
+        bench_query(&q[i].packet, name, DNS_T_A);
+        q[i].max = 1232;
+        q[i].ip = ip;
+        q[i].iplen = 4;
+      }
+
+      start = bench_time();
+      if (batched)
+        lookup_ctx_batch(&ctx, q, BATCH);
+      else
+        for (int i = 0; i < BATCH; i++)
+          lookup_ctx_batch(&ctx, q + i, 1);
+      elapsed[batched] += bench_time() - start;
+
+      if (q[0].packet.s[7] != 1)
+        errx(1, "No answer for %s", name);
+    }
+    printf("%-8ld  %12.0f  %7.0f  %6.2fx\n", range, queries / elapsed[0],
+      queries / elapsed[1], elapsed[0] / elapsed[1]);
+    if (range < names && range * 8 > names)
+      range = names / 8;
+  }
+  return 0;
+}
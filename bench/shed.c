@@ -0,0 +1,77 @@
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench/bench.h"
+#include "dns.h"
+#include "lookup.h"
+#include "stralloc.h"
+
+/* Time batches of 32 uncached queries of each kind, in microseconds per
+   query, as udpdns answers them normally and while shedding load, and
+   show whether each is shed. Only queries which would otherwise be
+   costly should become cheaper. */
+
+#define BATCH 32
+
+static const struct {
+  const char *label, *name, *type;
+} kinds[] = {
+  { "cheap A", "www.example.com", DNS_T_A },
+  { "wildcard", "a.b.c.d.e.f.g.h.i.j.k.l.example.com", DNS_T_A },
+  { "ANY", "example.com", DNS_T_ANY },
+  { "20 MX", "mx20.example.com", DNS_T_MX },
+  { "50 MX", "mx50.example.com", DNS_T_MX }
+};
+
+int main(int argc, char **argv) {
+  static struct lookup_query q[BATCH];
+  struct lookup_ctx ctx = { 0 };
+  stralloc query = { 0 };
+  int repeat = argc > 1 ? atoi(argv[1]) : 2000;
+  char ip[4] = { 127, 0, 0, 1 };
+  FILE *data = bench_data();
+
+  /* 50 MX targets do not fit in 512 bytes but 20 do, once their
+     addresses are dropped from the additional section. */
+  fprintf(data, ".example.com:ns.example.com\n");
+  fprintf(data, "+www.example.com:192.0.2.1\n");
+  fprintf(data, "+*.example.com:192.0.2.2\n");
+  for (int i = 0; i < 50; i++) {
+    if (i < 20)
+      fprintf(data, "@mx20.example.com:m%d.example.com:%d\n", i, i);
+    fprintf(data, "@mx50.example.com:m%d.example.com:%d\n", i, i);
+    fprintf(data, "+m%d.example.com:10.0.0.%d\n", i, i);
+  }
+  bench_load(data, &ctx);
+  if (!lookup_ctx_cache(&ctx, 0))
+    err(1, "malloc");
+
+  printf("query     normal  shedding  shed\n");
+  for (size_t k = 0; k < sizeof kinds / sizeof *kinds; k++) {
+    double elapsed[2];
+    uint64_t shed = ctx.shed;
+
+    bench_query(&query, kinds[k].name, kinds[k].type);
+    for (int shedding = 0; shedding < 2; shedding++) {
+      double start = bench_time();
+
+      for (int r = 0; r < repeat; r++) {
+        for (int i = 0; i < BATCH; i++) {
+          if (!stralloc_copyb(&q[i].packet, query.s, query.len))
+            err(1, "malloc");
+          q[i].max = 1232;
+          q[i].ip = ip;
+          q[i].iplen = 4;
+          q[i].shed = shedding;
+        }
+        lookup_ctx_batch(&ctx, q, BATCH);
+      }
+      elapsed[shedding] = (bench_time() - start) / repeat / BATCH * 1e6;
+    }
+    printf("%-8s  %6.2f  %8.2f  %4s\n", kinds[k].label, elapsed[0],
+      elapsed[1], ctx.shed > shed ? "yes" : "no");
+  }
+  return 0;
+}
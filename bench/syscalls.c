@@ -0,0 +1,284 @@
+#include <err.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench/bench.h"
+#include "dns.h"
+#include "lookup.h"
+#include "pack.h"
+#include "server.h"
+#include "stralloc.h"
+#include "tcp.h"
+#include "udp.h"
+
+/* Count the system calls udpdns and tcpdns make per query, serving a
+   client on the loopback interface from a child process. The server's
+   calls are counted through wrappers which the linker substitutes with
+   --wrap. UDP clients keep 32 queries outstanding on one socket and TCP
+   clients have one query at a time on each of 32 streams. */
+
+#define WINDOW 32
+
+enum { WAIT, RECEIVE, SEND, ACCEPT, CALLS };
+
+static uint64_t *count;
+static int server;
+
+#define WRAP(type, name, kind, params, args) \
+  type __real_##name params; \
+  type __wrap_##name params { \
+    if (server) \
+      count[kind]++; \
+    return __real_##name args; \
+  }
+
+WRAP(int, poll, WAIT, (struct pollfd *fds, nfds_t n, int timeout),
+  (fds, n, timeout))
+#ifdef EPOLLET
+WRAP(int, epoll_wait, WAIT,
+  (int fd, struct epoll_event *events, int max, int timeout),
+  (fd, events, max, timeout))
+#endif
+WRAP(ssize_t, recvmsg, RECEIVE, (int fd, struct msghdr *msg, int flags),
+  (fd, msg, flags))
+#ifdef MSG_WAITFORONE
+WRAP(int, recvmmsg, RECEIVE,
+  (int fd, struct mmsghdr *msg, unsigned n, int flags,
+    struct timespec *timeout),
+  (fd, msg, n, flags, timeout))
+#endif
+WRAP(ssize_t, read, RECEIVE, (int fd, void *buffer, size_t len),
+  (fd, buffer, len))
+WRAP(ssize_t, sendmsg, SEND, (int fd, const struct msghdr *msg, int flags),
+  (fd, msg, flags))
+#ifdef MSG_WAITFORONE
+WRAP(int, sendmmsg, SEND,
+  (int fd, struct mmsghdr *msg, unsigned n, int flags), (fd, msg, n, flags))
+#endif
+WRAP(ssize_t, writev, SEND, (int fd, const struct iovec *iov, int n),
+  (fd, iov, n))
+#ifdef SOCK_NONBLOCK
+WRAP(int, accept4, ACCEPT,
+  (int fd, struct sockaddr *sa, socklen_t *salen, int flags),
+  (fd, sa, salen, flags))
+#endif
+WRAP(int, accept, ACCEPT, (int fd, struct sockaddr *sa, socklen_t *salen),
+  (fd, sa, salen))
+WRAP(int, getpeername, ACCEPT,
+  (int fd, struct sockaddr *sa, socklen_t *salen), (fd, sa, salen))
+
+#ifdef __NR_io_uring_enter
+/* io_uring is reached through syscall(), which waits in io_uring_enter()
+   for completions as poll() or epoll_wait() would. */
+long __real_syscall(long number, ...);
+long __wrap_syscall(long number, ...) {
+  long arg[6];
+  va_list ap;
+
+  va_start(ap, number);
+  for (int i = 0; i < 6; i++)
+    arg[i] = va_arg(ap, long);
+  va_end(ap);
+  if (server && number == __NR_io_uring_enter)
+    count[WAIT]++;
+  return __real_syscall(number, arg[0], arg[1], arg[2], arg[3], arg[4],
+    arg[5]);
+}
+#endif
+
+int bindsocket(const struct addrinfo *info) {
+  int fd = socket(info->ai_family, info->ai_socktype, 0);
+
+  if (fd < 0)
+    err(1, "socket");
+  if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+    err(1, "fcntl F_SETFL O_NONBLOCK");
+  if (bind(fd, info->ai_addr, info->ai_addrlen) < 0)
+    err(1, "bind");
+  return fd;
+}
+
+static void serve_udp(struct lookup_ctx *ctx, int fd, int ring) {
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  static struct udp u;
+
+  if (!udp_init(&u, ctx, 32, 1232))
+    err(1, "malloc");
+  if (ring) {
+    if (!udp_ring(&u, &fd, 1))
+      _exit(2);
+    while (1)
+      udp_ring_wait(&u);
+  }
+  while (1)
+    if (poll(&pfd, 1, -1) > 0)
+      udp_receive(&u, fd);
+}
+
+static void serve_tcp(struct lookup_ctx *ctx, int fd, int ring) {
+  static struct tcp t;
+  void *ready[TCP_EVENTS];
+
+  tcp_listen(&t, fd);
+  tcp_init(&t, ctx, 256);
+  if (ring) {
+    if (!tcp_ring(&t))
+      _exit(2);
+    while (1)
+      tcp_ring_wait(&t);
+  }
+  while (1)
+    tcp_events(&t, ready, tcp_wait(&t, ready));
+}
+
+static void query_udp(const struct sockaddr *sa, socklen_t salen,
+    const stralloc *query, int queries) {
+  char buffer[512];
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  if (fd < 0 || connect(fd, sa, salen) < 0)
+    err(1, "socket");
+  for (int sent = 0, received = 0; received < queries; received++) {
+    while (sent < queries && sent - received < WINDOW)
+      if (send(fd, query->s, query->len, 0) == (ssize_t) query->len)
+        sent++;
+    if (recv(fd, buffer, sizeof buffer, 0) < 0)
+      err(1, "recv");
+  }
+  close(fd);
+}
+
+static void query_tcp(const struct sockaddr *sa, socklen_t salen,
+    const stralloc *query, int queries) {
+  struct pollfd fd[WINDOW];
+  char buffer[512];
+  int sent = 0, received = 0;
+
+  for (int i = 0; i < WINDOW; i++) {
+    fd[i].fd = socket(AF_INET, SOCK_STREAM, 0);
+    fd[i].events = POLLIN;
+    if (fd[i].fd < 0 || connect(fd[i].fd, sa, salen) < 0)
+      err(1, "connect");
+    if (sent < queries && write(fd[i].fd, query->s, query->len) > 0)
+      sent++;
+  }
+
+  /* Each response is small enough to arrive in one segment. */
+  while (received < queries) {
+    if (poll(fd, WINDOW, -1) < 0)
+      err(1, "poll");
+    for (int i = 0; i < WINDOW; i++)
+      if (fd[i].revents) {
+        if (read(fd[i].fd, buffer, sizeof buffer) <= 0)
+          errx(1, "Stream closed");
+        received++;
+        if (sent < queries && write(fd[i].fd, query->s, query->len) > 0)
+          sent++;
+      }
+  }
+  for (int i = 0; i < WINDOW; i++)
+    close(fd[i].fd);
+}
+
+int main(int argc, char **argv) {
+  static const struct {
+    const char *name;
+    int type, ring;
+  } engines[] = {
+    { "udp poll", SOCK_DGRAM, 0 },
+    { "udp io_uring", SOCK_DGRAM, 1 },
+    { "tcp epoll", SOCK_STREAM, 0 },
+    { "tcp io_uring", SOCK_STREAM, 1 }
+  };
+  int queries = argc > 1 ? atoi(argv[1]) : 100000;
+  struct lookup_ctx ctx = { 0 };
+  stralloc query = { 0 }, stream = { 0 };
+  char length[2];
+  FILE *data = bench_data();
+
+  fprintf(data, ".example.com:ns.example.com\n");
+  fprintf(data, "+www.example.com:192.0.2.1\n");
+  bench_load(data, &ctx);
+  bench_query(&query, "www.example.com", DNS_T_A);
+  pack_uint16_big(length, query.len);
+  if (!stralloc_copyb(&stream, length, 2)
+      || !stralloc_catb(&stream, query.s, query.len))
+    err(1, "malloc");
+  if (!lookup_ctx_cache(&ctx, 4096))
+    err(1, "malloc");
+
+  count = mmap(0, CALLS * sizeof *count, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (count == MAP_FAILED)
+    err(1, "mmap");
+
+  printf("engine        wait  receive  send  accept  calls/query\n");
+  for (size_t e = 0; e < sizeof engines / sizeof *engines; e++) {
+    struct sockaddr_in sin = { .sin_family = AF_INET };
+    struct addrinfo info = {
+      .ai_family = AF_INET,
+      .ai_socktype = engines[e].type,
+      .ai_addr = (struct sockaddr *) &sin,
+      .ai_addrlen = sizeof sin
+    };
+    socklen_t salen = sizeof sin;
+    uint64_t calls = 0;
+    int fd, status;
+    pid_t pid;
+
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = engines[e].type == SOCK_DGRAM ? udp_socket(&info)
+      : tcp_socket(&info, 0, 0);
+    if (getsockname(fd, (struct sockaddr *) &sin, &salen) < 0)
+      err(1, "getsockname");
+    memset(count, 0, CALLS * sizeof *count);
+
+    if ((pid = fork()) < 0)
+      err(1, "fork");
+    if (pid == 0) {
+      server = 1;
+      if (engines[e].type == SOCK_DGRAM)
+        serve_udp(&ctx, fd, engines[e].ring);
+      serve_tcp(&ctx, fd, engines[e].ring);
+    }
+    close(fd);
+
+    /* Give a server without io_uring a moment to give up. */
+    usleep(100000);
+    if (waitpid(pid, &status, WNOHANG) == pid) {
+      printf("%-12s  unavailable\n", engines[e].name);
+      continue;
+    }
+
+    if (engines[e].type == SOCK_DGRAM)
+      query_udp((struct sockaddr *) &sin, salen, &query, queries);
+    else
+      query_tcp((struct sockaddr *) &sin, salen, &stream, queries);
+    kill(pid, SIGKILL);
+    waitpid(pid, 0, 0);
+
+    for (int i = 0; i < CALLS; i++)
+      calls += count[i];
+    printf("%-12s  %4.2f  %7.2f  %4.2f  %6.4f  %11.2f\n", engines[e].name,
+      (double) count[WAIT] / queries, (double) count[RECEIVE] / queries,
+      (double) count[SEND] / queries, (double) count[ACCEPT] / queries,
+      (double) calls / queries);
+  }
+  return 0;
+}
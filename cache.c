@@ -0,0 +1,100 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+static uint32_t hash(const char *key, size_t len) {
+  uint32_t h = 5381;
+
+  while (len--)
+    h = (h + (h << 5)) ^ (uint8_t) *key++;
+  return h;
+}
+
+int cache_init(struct cache *cache, size_t entries) {
+  cache_free(cache);
+  if (entries == 0)
+    return 1;
+
+  cache->sets = (entries + CACHE_WAYS - 1) / CACHE_WAYS;
+  cache->entry = calloc(cache->sets * CACHE_WAYS, sizeof *cache->entry);
+  if (!cache->entry)
+    cache->sets = 0;
+  return cache->entry != 0;
+}
+
+void cache_free(struct cache *cache) {
+  for (size_t i = 0; i < cache->sets * CACHE_WAYS; i++)
+    free(cache->entry[i].data);
+  free(cache->entry);
+  cache->entry = 0;
+  cache->sets = 0;
+}
+
+const char *cache_get(struct cache *cache, const char *key, size_t keylen,
+    uint64_t generation, uint64_t now, size_t *len) {
+  uint32_t h = hash(key, keylen);
+  struct cache_entry *e;
+
+  if (cache->sets == 0)
+    return 0;
+
+  e = cache->entry + h % cache->sets * CACHE_WAYS;
+  for (size_t i = 0; i < CACHE_WAYS; i++, e++)
+    if (e->hash == h && e->keylen == keylen && e->used)
+      if (e->generation == generation && now < e->expires)
+        if (!memcmp(e->data, key, keylen)) {
+          e->used = ++cache->tick;
+          cache->hits++;
+          *len = e->len;
+          return e->data + keylen;
+        }
+
+  cache->misses++;
+  return 0;
+}
+
+int cache_put(struct cache *cache, const char *key, size_t keylen,
+    const char *data, size_t len, uint64_t generation, uint64_t expires) {
+  uint32_t h = hash(key, keylen);
+  struct cache_entry *e, *victim;
+
+  if (cache->sets == 0 || len > CACHE_LIMIT || keylen > UINT16_MAX)
+    return 0;
+
+  /* Overwrite the same key or a stale entry if there is one, otherwise
+     the entry least recently used in this set. */
+  victim = e = cache->entry + h % cache->sets * CACHE_WAYS;
+  for (size_t i = 0; i < CACHE_WAYS; i++, e++) {
+    if (!e->used || e->generation != generation) {
+      victim = e;
+      break;
+    }
+    if (e->hash == h && e->keylen == keylen)
+      if (!memcmp(e->data, key, keylen)) {
+        victim = e;
+        break;
+      }
+    if (e->used < victim->used)
+      victim = e;
+  }
+
+  if (victim->size < keylen + len) {
+    char *data = realloc(victim->data, keylen + len);
+    if (!data)
+      return 0;
+    victim->data = data;
+    victim->size = keylen + len;
+  }
+
+  memcpy(victim->data, key, keylen);
+  memcpy(victim->data + keylen, data, len);
+  victim->expires = expires;
+  victim->generation = generation;
+  victim->used = ++cache->tick;
+  victim->hash = h;
+  victim->keylen = keylen;
+  victim->len = len;
+  return 1;
+}
@@ -0,0 +1,37 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LIMIT 4096 /* largest response worth keeping */
+#define CACHE_WAYS 4
+
+struct cache_entry {
+  uint64_t expires;
+  uint64_t generation;
+  uint64_t used;
+  uint32_t hash;
+  uint16_t keylen;
+  uint16_t len;
+  size_t size;
+  char *data; /* key followed by response */
+};
+
+struct cache {
+  struct cache_entry *entry;
+  size_t sets;
+  uint64_t tick;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+int cache_init(struct cache *cache, size_t entries);
+void cache_free(struct cache *cache);
+
+const char *cache_get(struct cache *cache, const char *key, size_t keylen,
+  uint64_t generation, uint64_t now, size_t *len);
+int cache_put(struct cache *cache, const char *key, size_t keylen,
+  const char *data, size_t len, uint64_t generation, uint64_t expires);
+
+#endif
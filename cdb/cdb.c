@@ -45,10 +45,8 @@ int cdb_read(struct cdb *c, char *out, size_t len, uint32_t pos) {
     memcpy(out, c->map + pos, len);
     return 0;
   }
-  if (lseek(c->fd, pos, SEEK_SET) < 0)
-    return -1;
   while (len > 0) {
-    ssize_t count = read(c->fd, out, len);
+    ssize_t count = pread(c->fd, out, len, pos);
     if (count < 0 && errno == EINTR)
       continue;
     if (count == 0)
@@ -56,6 +54,7 @@ int cdb_read(struct cdb *c, char *out, size_t len, uint32_t pos) {
     if (count <= 0)
       return -1;
     out += count;
+    pos += count;
     len -= count;
   }
   return 0;
@@ -126,3 +125,37 @@ int cdb_find(struct cdb *c, const char *key, size_t len) {
   cdb_findstart(c);
   return cdb_findnext(c, key, len);
 }
+
+void cdb_prefetch(struct cdb *c, struct cdb_probe *p, const char *key,
+    size_t len) {
+  p->hash = cdb_hash(key, len);
+  p->kpos = 0;
+  if (c->map && c->size >= 2048)
+    __builtin_prefetch(c->map + ((p->hash << 3) & 2047));
+}
+
+/* The first call reads the header to find the hash slot and the second
+   reads the slot to find the record. Neither is ever required. */
+
+void cdb_prefetchnext(struct cdb *c, struct cdb_probe *p) {
+  uint32_t hpos, hslots, pos;
+
+  if (!c->map || c->size < 2048)
+    return;
+
+  if (p->kpos == 0) {
+    hpos = unpack_uint32(c->map + ((p->hash << 3) & 2047));
+    hslots = unpack_uint32(c->map + ((p->hash << 3) & 2047) + 4);
+    if (hslots == 0)
+      return;
+    p->kpos = hpos + ((p->hash >> 8) % hslots << 3);
+    if (p->kpos < c->size && c->size - p->kpos >= 8)
+      __builtin_prefetch(c->map + p->kpos);
+    else
+      p->kpos = 0;
+  } else if (unpack_uint32(c->map + p->kpos) == p->hash) {
+    pos = unpack_uint32(c->map + p->kpos + 4);
+    if (pos < c->size)
+      __builtin_prefetch(c->map + pos);
+  }
+}
@@ -17,6 +17,14 @@ struct cdb {
   uint32_t dlen; /* initialized if cdb_findnext() returns 1 */
 };
 
+/* Warm the path to a key in a mapped database one dependent step at a
+   time, so the cache misses of several lookups can be overlapped. */
+
+struct cdb_probe {
+  uint32_t hash;
+  uint32_t kpos; /* 0 until the hash slot is known */
+};
+
 static inline uint32_t cdb_datapos(struct cdb *c) {
   return c->dpos;
 }
@@ -48,4 +56,8 @@ void cdb_findstart(struct cdb *c);
 int cdb_findnext(struct cdb *c, const char *key, size_t len);
 int cdb_find(struct cdb *c, const char *key, size_t len);
 
+void cdb_prefetch(struct cdb *c, struct cdb_probe *p, const char *key,
+  size_t len);
+void cdb_prefetchnext(struct cdb *c, struct cdb_probe *p);
+
 #endif
@@ -17,6 +17,9 @@
 
 static struct cdb_make cdb;
 static stralloc f[15], key, rr;
+static stralloc cuts, prefix4, prefix6;
+static size_t cutpos;
+static uint32_t prefixc;
 
 static stralloc soa_rname;
 static uint32_t soa_serial;
@@ -53,6 +56,40 @@ static int parse_loc(char loc[2], const stralloc *in) {
   return 1;
 }
 
+static int parse_prefix(stralloc *out, const stralloc *in, size_t width,
+    const char loc[2]) {
+  char record[23] = { 0 }; /* address, length, location, sequence */
+  size_t len, n;
+  uint8_t bits;
+
+  n = width == 4 ? scan_ip4(in->s, record) : scan_ip6(in->s, record);
+  if (n > 0 && in->s[n] == '/') {
+    len = scan_uint8(in->s + n + 1, &bits);
+    if (len == 0 || n + len + 1 != in->len || bits > 8 * width)
+      return 0;
+  } else {
+    memset(record, 0, 16);
+    if (width == 4)
+      n = scan_ip4_prefix(in->s, record, &len, 4);
+    else
+      n = scan_ip6_prefix(in->s, record, &len, 16);
+    if (n != in->len)
+      return 0;
+    bits = 8 * len;
+  }
+
+  for (size_t i = 0; i < 16; i++)
+    if (8 * i + 8 > bits)
+      record[i] &= 8 * i < bits ? 0xff << (8 * i + 8 - bits) : 0;
+  record[16] = bits;
+  memcpy(record + 17, loc, 2);
+  pack_uint32_big(record + 19, prefixc++);
+
+  if (!stralloc_catb(out, record, sizeof record))
+    err(1, "stralloc");
+  return 1;
+}
+
 static int parse_name(stralloc *out, const stralloc *in) {
   if (dns_domain_fromdot(out, in->s, in->len))
     return 1;
@@ -183,6 +220,19 @@ static void rr_finish(const char *owner) {
   stralloc_lower(&key);
   if (cdb_make_add(&cdb, key.s, key.len, rr.s, rr.len) < 0)
     err(1, "cdb");
+
+  /* Index every name with SOA or NS records as a potential zone cut,
+     skipping the usual run of repeats for one zone. */
+  if (rr.s[2] == '*' || rr.s[2] == '+')
+    return;
+  if (memcmp(rr.s, DNS_T_SOA, 2) && memcmp(rr.s, DNS_T_NS, 2))
+    return;
+  if (cuts.len - cutpos == key.len && !memcmp(cuts.s + cutpos, key.s,
+      key.len))
+    return;
+  cutpos = cuts.len;
+  if (!stralloc_catb(&cuts, key.s, key.len))
+    err(1, "stralloc");
 }
 
 static int append(void) {
@@ -197,28 +247,12 @@ static int append(void) {
     case '%':
       if (!parse_loc(loc, &f[0]))
         return 0;
-      if (f[1].len == 1 && *f[1].s == '4') {
-        if (scan_ip4_prefix(f[2].s, bytes, &len, 4) == f[2].len) {
-          if (!stralloc_copyb(&key, "\0%", 2))
-            err(1, "stralloc");
-          if (!stralloc_catb(&key, bytes, len))
-            err(1, "stralloc");
-          if (cdb_make_add(&cdb, key.s, key.len, loc, 2) < 0)
-            err(1, "cdb");
+      if (f[1].len == 1 && *f[1].s == '4')
+        if (parse_prefix(&prefix4, &f[2], 4, loc))
           return 1;
-        }
-      }
-      if (f[1].len == 1 && *f[1].s == '6') {
-        if (scan_ip6_prefix(f[2].s, bytes, &len, 16) == f[2].len) {
-          if (!stralloc_copyb(&key, "\0&", 2))
-            err(1, "stralloc");
-          if (!stralloc_catb(&key, bytes, len))
-            err(1, "stralloc");
-          if (cdb_make_add(&cdb, key.s, key.len, loc, 2) < 0)
-            err(1, "cdb");
+      if (f[1].len == 1 && *f[1].s == '6')
+        if (parse_prefix(&prefix6, &f[2], 16, loc))
           return 1;
-        }
-      }
       return fail("Invalid address prefix: %s:%s", f[1].s, f[2].s);
 
     case '!':
@@ -506,6 +540,96 @@ static int append(void) {
   return fail("Unrecognized leading character: %c", *line);
 }
 
+static int prefix_compare(const void *a, const void *b) {
+  int rc = memcmp(a, b, 17); /* address then length */
+  return rc ? rc : memcmp((char *) a + 19, (char *) b + 19, 4);
+}
+
+static void prefix_emit(stralloc *out, const char *start, const char *loc,
+    size_t width) {
+  size_t size = width + 2;
+
+  /* A later boundary at the same address supersedes an earlier one, and
+     adjacent ranges in the same location are merged. */
+  if (out->len >= size && !memcmp(out->s + out->len - size, start, width))
+    out->len -= size;
+  if (out->len >= size && !memcmp(out->s + out->len - 2, loc, 2))
+    return;
+  if (!stralloc_catb(out, start, width) || !stralloc_catb(out, loc, 2))
+    err(1, "stralloc");
+}
+
+static int prefix_pop(stralloc *out, char (*stack)[18], size_t *depth,
+    size_t width) {
+  char *last = stack[--*depth], next[16];
+  size_t i = width;
+
+  memcpy(next, last, width);
+  while (i-- > 0)
+    if (++next[i])
+      break;
+  if (i + 1 == 0)
+    return 0; /* range extends to the end of the address space */
+  prefix_emit(out, next, *depth ? stack[*depth - 1] + 16 : "\0\0", width);
+  return 1;
+}
+
+static void prefix_table(stralloc *prefixes, size_t width, const char *name) {
+  static stralloc table, out;
+  char stack[129][18], *p, *q;
+  size_t bits, count, depth = 0, size = width + 2;
+
+  /* Flatten nested prefixes into sorted disjoint address ranges, each
+     starting with its first address and carrying the location of the
+     longest prefix covering it. The first duplicate of a prefix wins. */
+  qsort(prefixes->s, prefixes->len / 23, 23, prefix_compare);
+  stralloc_zero(&table);
+  prefix_emit(&table, "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0", "\0\0", width);
+
+  for (size_t i = 0; i < prefixes->len; i += 23) {
+    p = prefixes->s + i;
+    if (i > 0 && !memcmp(p, p - 23, 17))
+      continue;
+    while (depth > 0 && memcmp(stack[depth - 1], p, width) < 0)
+      prefix_pop(&table, stack, &depth, width);
+
+    prefix_emit(&table, p, p + 17, width);
+    memcpy(stack[depth], p, 16);
+    for (size_t j = 0; j < 16; j++)
+      if (8 * j + 8 > (uint8_t) p[16])
+        stack[depth][j] |= 8 * j < (uint8_t) p[16]
+          ? 0xff >> ((uint8_t) p[16] - 8 * j) : 0xff;
+    memcpy(stack[depth++] + 16, p + 17, 2);
+  }
+  while (depth > 0)
+    prefix_pop(&table, stack, &depth, width);
+
+  /* Index the ranges by the top bits of their addresses so a lookup only
+     has to binary search the few ranges within one block. */
+  count = table.len / size;
+  for (bits = 0; bits < 16 && (size_t) 1 << bits < count; bits++)
+    continue;
+
+  if (!stralloc_copyb(&out, &(char) { bits }, 1))
+    err(1, "stralloc");
+  for (size_t block = 0, j = 0; block < (size_t) 1 << bits; block++) {
+    char start[16] = { 0 }, buffer[4];
+
+    pack_uint16_big(start, block << (16 - bits));
+    while (j + 1 < count && memcmp(table.s + (j + 1) * size, start, width) <= 0)
+      j++;
+    pack_uint32_big(buffer, j);
+    if (!stralloc_catb(&out, buffer, 4))
+      err(1, "stralloc");
+  }
+  pack_uint32_big(q = (char [4]) { 0 }, count - 1);
+  if (!stralloc_catb(&out, q, 4) || !stralloc_catb(&out, table.s, table.len))
+    err(1, "stralloc");
+
+  if (cdb_make_add(&cdb, name, 3, out.s, out.len) < 0)
+    err(1, "cdb");
+}
+
 static int usage(const char *progname) {
   fprintf(stderr, "\
 Usage: %s [OPTIONS] < DATAFILE\n\
@@ -588,6 +712,10 @@ int main(int argc, char **argv) {
       failc++;
   }
 
+  if (cdb_make_add(&cdb, "\0.", 2, cuts.s, cuts.len) < 0)
+    err(1, "cdb");
+  prefix_table(&prefix4, 4, "\0/4");
+  prefix_table(&prefix6, 16, "\0/6");
   if (cdb_make_finish(&cdb) < 0)
     err(1, "cdb");
 
@@ -1,43 +1,82 @@
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "cache.h"
 #include "cdb/cdb.h"
 #include "dns.h"
+#include "lookup.h"
 #include "pack.h"
 #include "response.h"
 
-static struct cdb c;
-static char cloc[2];
-static uint64_t now;
+struct prefixes {
+  char *copy;
+  const char *index;
+  const char *ranges;
+  uint32_t count;
+  uint8_t bits;
+};
+
+struct zones {
+  char *copy;
+  const char *names;
+  struct zone {
+    uint32_t hash;
+    uint32_t pos;
+  } *table;
+  uint32_t mask;
+};
 
-static char data[65536];
-static size_t dlen;
-static size_t dpos;
+struct mapping {
+  struct cdb c;
+  struct prefixes prefix4, prefix6;
+  int legacy; /* locations are in per-prefix keys from an older dnsdata */
+  struct zones zones;
+  uint64_t generation;
+  struct stat st;
+  size_t refs;
+};
 
-static uint64_t ttd;
-static uint32_t ttl;
-static char type[2];
+struct database {
+  struct database *next;
+  struct mapping *current;
+  char *filename;
+  pthread_t watcher;
+};
 
-static int dobytes(size_t len) {
-  if (dlen < dpos + len)
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct database *databases;
+static uint64_t generation;
+
+static int dobytes(struct lookup_ctx *ctx, size_t len) {
+  if (ctx->dlen < ctx->dpos + len)
     return 0;
-  if (!response_addbytes(data + dpos, len))
+  if (!response_addbytes(&ctx->response, ctx->data + ctx->dpos, len))
     return 0;
-  dpos += len;
+  ctx->dpos += len;
   return 1;
 }
 
-static int doname(stralloc *name) {
-  if (!dns_packet_getname(&dpos, name, data, dlen))
+static int doname(struct lookup_ctx *ctx, stralloc *name) {
+  if (!dns_packet_getname(&ctx->dpos, name, ctx->data, ctx->dlen))
     return 0;
-  return response_addname(name->s);
+  return response_addname(&ctx->response, name->s);
 }
 
-static int dowild(stralloc *name, const char *replace, size_t len) {
-  if (!dns_packet_getname(&dpos, name, data, dlen))
+static int dowild(struct lookup_ctx *ctx, stralloc *name,
+    const char *replace, size_t len) {
+  if (!dns_packet_getname(&ctx->dpos, name, ctx->data, ctx->dlen))
     return 0;
   if (name->s[0] == 1 && name->s[1] == '*') {
     if (!stralloc_ready(name, name->len + len - 2))
@@ -45,30 +84,63 @@ static int dowild(stralloc *name, const char *replace, size_t len) {
     memmove(name->s + len, name->s + 2, name->len - 2);
     memcpy(name->s, replace, len);
   }
-  return response_addname(name->s);
+  return response_addname(&ctx->response, name->s);
 }
 
-static int find(char *name, int wild) {
-  while (1) {
-    char byte, rloc[2], ttlstr[4], ttdstr[8];
-    int rc = cdb_findnext(&c, name, dns_domain_length(name));
+static void expire(struct lookup_ctx *ctx, uint64_t time) {
+  if (ctx->expires > time)
+    ctx->expires = time;
+}
 
-    if (rc <= 0)
-      return rc;
-    if (dlen = cdb_datalen(&c), dlen > sizeof data)
-      return -1;
-    if (cdb_read(&c, data, dlen, cdb_datapos(&c)) < 0)
-      return -1;
+static int fetch(struct lookup_ctx *ctx, struct lookup_rrset *set,
+    const char *name, int wild) {
+  size_t len = dns_domain_length(name);
+  struct cdb *c = &ctx->c;
+  int rc;
 
-    if (dpos = 0, !dns_packet_copy(&dpos, type, 2, data, dlen))
-      return -1;
-    if (!dns_packet_copy(&dpos, &byte, 1, data, dlen))
-      return -1;
+  if (set->valid && set->wild == wild && set->name.len == len)
+    if (!memcmp(set->name.s, name, len))
+      return 1;
+
+  /* Decode every visible record at name in one scan, leaving the rdata
+     in place when the database is mapped and copying it otherwise. */
+  set->valid = 0;
+  set->count = 0;
+  stralloc_zero(&set->data);
+  cdb_findstart(c);
+
+  while ((rc = cdb_findnext(c, name, len))) {
+    char byte, rloc[2], ttlstr[4], ttdstr[8], type[2];
+    uint32_t dlen = cdb_datalen(c), dpos = cdb_datapos(c);
+    const char *data;
+    size_t pos = 0, start;
+
+    if (rc < 0)
+      return 0;
+    if (c->map) {
+      if (dpos > c->size || c->size - dpos < dlen)
+        return 0;
+      data = c->map + dpos;
+      start = dpos;
+    } else {
+      if (!stralloc_ready(&set->data, set->data.len + dlen))
+        return 0;
+      data = set->data.s + set->data.len;
+      if (cdb_read(c, set->data.s + set->data.len, dlen, dpos) < 0)
+        return 0;
+      start = set->data.len;
+      set->data.len += dlen;
+    }
+
+    if (!dns_packet_copy(&pos, type, 2, data, dlen))
+      return 0;
+    if (!dns_packet_copy(&pos, &byte, 1, data, dlen))
+      return 0;
 
     if (byte == '=' + 1 || byte == '*' + 1) {
-      if (!dns_packet_copy(&dpos, rloc, 2, data, dlen))
-        return -1;
-      if (memcmp(rloc, cloc, 2))
+      if (!dns_packet_copy(&pos, rloc, 2, data, dlen))
+        return 0;
+      if (memcmp(rloc, ctx->cloc, 2))
         continue;
       byte--;
     }
@@ -76,79 +148,455 @@ static int find(char *name, int wild) {
     if (wild != (byte == '*'))
       continue;
 
-    if (!dns_packet_copy(&dpos, ttlstr, 4, data, dlen))
-      return -1;
-    if (!dns_packet_copy(&dpos, ttdstr, 8, data, dlen))
-      return -1;
-    ttl = unpack_uint32_big(ttlstr);
-    ttd = unpack_uint64_big(ttdstr);
+    if (!dns_packet_copy(&pos, ttlstr, 4, data, dlen))
+      return 0;
+    if (!dns_packet_copy(&pos, ttdstr, 8, data, dlen))
+      return 0;
+    ctx->ttl = unpack_uint32_big(ttlstr);
+    ctx->ttd = unpack_uint64_big(ttdstr);
 
-    if (now - ttd >= 0x8000000000000000)
+    /* Track when the answer could next change: the earliest TTL expiry
+       or unpublished record becoming visible. A clipped TTL changes
+       every second. */
+    if (ctx->now - ctx->ttd >= 0x8000000000000000) {
+      if (ctx->ttd < 0x8000000000000000)
+        expire(ctx, ctx->ttd);
       continue;
-    if (now - ttd + ttl >= 0x8000000000000000)
-      ttl = 0x8000000000000000 - now + ttd;
-    return 1;
+    }
+    if (ctx->now - ctx->ttd + ctx->ttl >= 0x8000000000000000) {
+      ctx->ttl = 0x8000000000000000 - ctx->now + ctx->ttd;
+      expire(ctx, ctx->now + 1);
+    }
+    expire(ctx, ctx->now + ctx->ttl);
+
+    if (set->count == set->size) {
+      size_t size = set->size ? 2 * set->size : 16;
+      struct lookup_rr *rr = realloc(set->rr, size * sizeof *rr);
+      if (!rr)
+        return 0;
+      set->rr = rr;
+      set->size = size;
+    }
+    set->rr[set->count++] = (struct lookup_rr) {
+      .pos = start + pos,
+      .len = dlen - pos,
+      .ttl = ctx->ttl,
+      .type = { type[0], type[1] }
+    };
+  }
+
+  if (!stralloc_copyb(&set->name, name, len))
+    return 0;
+  set->base = c->map ? c->map : set->data.s;
+  set->valid = 1;
+  set->wild = wild;
+  return 1;
+}
+
+static void rrset_free(struct lookup_rrset *set) {
+  stralloc_free(&set->name);
+  stralloc_free(&set->data);
+  free(set->rr);
+  *set = (struct lookup_rrset) { 0 };
+}
+
+static void use(struct lookup_ctx *ctx, struct lookup_rrset *set,
+    size_t i) {
+  ctx->data = set->base + set->rr[i].pos;
+  ctx->dlen = set->rr[i].len;
+  ctx->dpos = 0;
+  ctx->ttl = set->rr[i].ttl;
+  memcpy(ctx->type, set->rr[i].type, 2);
+}
+
+static int classify(const struct prefixes *p, const char *ip, size_t width,
+    char loc[2]) {
+  uint32_t block, lo, hi, mid;
+  const char *range;
+
+  if (!p->ranges)
+    return 0;
+
+  /* Narrow to the ranges starting within the block indexed by the top
+     address bits, then find the last range starting at or before ip. */
+  block = unpack_uint16_big(ip) >> (16 - p->bits);
+  lo = unpack_uint32_big(p->index + 4 * block);
+  hi = unpack_uint32_big(p->index + 4 * block + 4);
+  while (lo < hi) {
+    mid = hi - (hi - lo) / 2;
+    if (memcmp(p->ranges + mid * (width + 2), ip, width) <= 0)
+      lo = mid;
+    else
+      hi = mid - 1;
   }
+  range = p->ranges + lo * (width + 2);
+  memcpy(loc, range + width, 2);
+  return 1;
 }
 
-static int locate(const void *ip, size_t len) {
+/* Databases built before the prefix tables were introduced store each
+   location prefix under its own key, which is probed from the longest
+   possible prefix downwards. */
+
+static int locate_legacy(struct lookup_ctx *ctx, const void *ip,
+    size_t len) {
   char key[18];
   int rc = 0;
 
-  memset(cloc, 0, 2);
   switch (len) {
-    case 4: /* IPv4 */
+    case 4:
       memcpy(key, "\0%", 2);
       memcpy(key + 2, ip, 4);
       for (int n = 6; n >= 2 && rc == 0; n--)
-        if ((rc = cdb_find(&c, key, n)) < 0)
+        if ((rc = cdb_find(&ctx->c, key, n)) < 0)
           return 0;
       break;
-    case 16: /* IPv6 */
+    case 16:
       memcpy(key, "\0&", 2);
       memcpy(key + 2, ip, 16);
       for (int n = 18; n >= 2 && rc == 0; n -= 2)
-        if ((rc = cdb_find(&c, key, n)) < 0)
+        if ((rc = cdb_find(&ctx->c, key, n)) < 0)
           return 0;
       break;
   }
 
-  if (rc > 0 && cdb_datalen(&c) == 2)
-    if (cdb_read(&c, cloc, 2, cdb_datapos(&c)) < 0)
+  if (rc > 0 && cdb_datalen(&ctx->c) == 2)
+    if (cdb_read(&ctx->c, ctx->cloc, 2, cdb_datapos(&ctx->c)) < 0)
+      return 0;
+  return 1;
+}
+
+/* Clients on a dual-stack socket arrive with v4-mapped addresses, which
+   are located as the IPv4 addresses they carry. */
+
+static int locate(struct lookup_ctx *ctx, const void *ip, size_t len) {
+  static const uint8_t mapped[12] = { [10] = 0xff, [11] = 0xff };
+
+  if (len == 16 && !memcmp(ip, mapped, sizeof mapped))
+    ip = (const uint8_t *) ip + 12, len = 4;
+  memset(ctx->cloc, 0, 2);
+  if (ctx->map && ctx->map->legacy)
+    return locate_legacy(ctx, ip, len);
+  if (ctx->map && len == 4)
+    classify(&ctx->map->prefix4, ip, 4, ctx->cloc);
+  if (ctx->map && len == 16)
+    classify(&ctx->map->prefix6, ip, 16, ctx->cloc);
+  return 1;
+}
+
+static void prefixes_free(struct prefixes *p) {
+  free(p->copy);
+  *p = (struct prefixes) { 0 };
+}
+
+static int prefixes_parse(struct prefixes *p, const char *data,
+    uint32_t dlen, size_t width) {
+  uint32_t blocks, count, last = 0;
+
+  /* Reject a malformed table up front so classify() need not check. */
+  if (dlen < 1 || (uint8_t) data[0] > 16)
+    return 0;
+  blocks = (uint32_t) 1 << data[0];
+  if (dlen < 1 + 4 * (blocks + 1))
+    return 0;
+  if ((dlen - 1 - 4 * (blocks + 1)) % (width + 2))
+    return 0;
+  count = (dlen - 1 - 4 * (blocks + 1)) / (width + 2);
+
+  for (uint32_t i = 0; i <= blocks; i++) {
+    uint32_t u = unpack_uint32_big(data + 1 + 4 * i);
+    if (u < last || u >= count)
+      return 0;
+    last = u;
+  }
+
+  p->bits = data[0];
+  p->index = data + 1;
+  p->ranges = data + 1 + 4 * (blocks + 1);
+  p->count = count;
+  return 1;
+}
+
+static void prefixes_load(struct prefixes *p, struct cdb *c,
+    const char *key, size_t width) {
+  uint32_t dlen, dpos;
+
+  if (cdb_find(c, key, 3) <= 0)
+    return;
+  dlen = cdb_datalen(c);
+  dpos = cdb_datapos(c);
+
+  /* Use the table in place when the database is mapped. */
+  if (c->map && dpos <= c->size && c->size - dpos >= dlen) {
+    if (!prefixes_parse(p, c->map + dpos, dlen, width))
+      prefixes_free(p);
+  } else if ((p->copy = malloc(dlen))) {
+    if (cdb_read(c, p->copy, dlen, dpos) < 0)
+      prefixes_free(p);
+    else if (!prefixes_parse(p, p->copy, dlen, width))
+      prefixes_free(p);
+  }
+}
+
+static uint32_t zones_hash(uint32_t h, const char *label) {
+  for (size_t i = 0; i <= (uint8_t) *label; i++)
+    h = cdb_hashadd(h, label[i]);
+  return h;
+}
+
+static size_t zones_labels(const char *name, const char *labels[128]) {
+  size_t count = 0;
+
+  while (*name && count < 127) {
+    labels[count++] = name;
+    name += (uint8_t) *name + 1;
+  }
+  labels[count++] = name;
+  return count;
+}
+
+static void zones_free(struct zones *z) {
+  free(z->copy);
+  free(z->table);
+  *z = (struct zones) { 0 };
+}
+
+static int zones_parse(struct zones *z, const char *data, uint32_t dlen) {
+  const char *labels[128];
+  size_t count = 0, i, n, pos;
+  uint32_t h;
+
+  /* Reject a malformed index up front so zones_find() need not check. */
+  for (pos = 0, n = 0; pos < dlen; ) {
+    uint8_t byte = data[pos];
+    if (byte > 63 || n + byte + 1 > 255)
       return 0;
+    pos += byte + 1;
+    n += byte + 1;
+    if (byte == 0)
+      count++, n = 0;
+  }
+  if (pos != dlen || n != 0)
+    return 0;
+
+  for (z->mask = 1; z->mask < 2 * count; z->mask <<= 1)
+    continue;
+  if (!(z->table = calloc(z->mask--, sizeof *z->table)))
+    return 0;
+
+  /* Hash names from the root label down, matching the order in which
+     zones_find() visits the suffixes of a query name. */
+  for (pos = 0; pos < dlen; pos += dns_domain_length(data + pos)) {
+    n = zones_labels(data + pos, labels);
+    for (h = 5381; n-- > 1; )
+      h = zones_hash(h, labels[n - 1]);
+    for (i = h & z->mask; z->table[i].pos; i = (i + 1) & z->mask)
+      continue;
+    z->table[i] = (struct zone) { h, pos + 1 };
+  }
+  z->names = data;
   return 1;
 }
 
-static void refresh(const char *filename) {
-  static int fd = -1;
-  static time_t refreshed = 0;
+static void zones_load(struct zones *z, struct cdb *c) {
+  uint32_t dlen, dpos;
 
-  if (fd >= 0 && now < refreshed + 10)
+  if (cdb_find(c, "\0.", 2) <= 0)
     return;
+  dlen = cdb_datalen(c);
+  dpos = cdb_datapos(c);
 
-  cdb_free(&c);
-  if (fd >= 0)
+  if (c->map && dpos <= c->size && c->size - dpos >= dlen) {
+    if (!zones_parse(z, c->map + dpos, dlen))
+      zones_free(z);
+  } else if ((z->copy = malloc(dlen ? dlen : 1))) {
+    if (cdb_read(c, z->copy, dlen, dpos) < 0)
+      zones_free(z);
+    else if (!zones_parse(z, z->copy, dlen))
+      zones_free(z);
+  }
+}
+
+static size_t zones_find(struct lookup_ctx *ctx, char *name,
+    char *cuts[128]) {
+  struct zones *z = ctx->map ? &ctx->map->zones : 0;
+  const char *labels[128], *cut;
+  size_t count, found = 0, len;
+  uint32_t h = 5381;
+
+  /* Without an index every ancestor is a potential zone cut. */
+  count = zones_labels(name, labels);
+  if (!z || !z->table) {
+    while (count-- > 0)
+      cuts[found++] = (char *) labels[count];
+    return found;
+  }
+
+  /* Otherwise visit the suffixes of name from the root down in a single
+     pass, hashing one more label each step and collecting those indexed.
+     Either way the closest enclosing cut is collected last. */
+  while (count-- > 0) {
+    if (*labels[count])
+      h = zones_hash(h, labels[count]);
+    len = dns_domain_length(labels[count]);
+    for (uint32_t i = h & z->mask; z->table[i].pos; i = (i + 1) & z->mask) {
+      cut = z->names + z->table[i].pos - 1;
+      if (z->table[i].hash == h && dns_domain_length(cut) == len)
+        if (!memcmp(cut, labels[count], len)) {
+          cuts[found++] = (char *) labels[count];
+          break;
+        }
+    }
+  }
+  return found;
+}
+
+static void release(struct mapping *map) {
+  if (map && --map->refs == 0) {
+    prefixes_free(&map->prefix4);
+    prefixes_free(&map->prefix6);
+    zones_free(&map->zones);
+    cdb_free(&map->c);
+    if (map->c.fd >= 0)
+      close(map->c.fd);
+    free(map);
+  }
+}
+
+static int changed(struct mapping *map, struct stat *st) {
+  if (!map)
+    return 1;
+  if (map->st.st_dev != st->st_dev || map->st.st_ino != st->st_ino)
+    return 1;
+  if (map->st.st_size != st->st_size)
+    return 1;
+  if (map->st.st_mtim.tv_sec != st->st_mtim.tv_sec)
+    return 1;
+  return map->st.st_mtim.tv_nsec != st->st_mtim.tv_nsec;
+}
+
+static struct mapping *prepare(struct database *db) {
+  struct mapping *map;
+  struct stat st;
+  int fd;
+
+  /* Only the watcher replaces db->current after the first load, so it
+     can safely be compared here without the lock. */
+  if ((fd = open(db->filename, O_RDONLY | O_CLOEXEC)) < 0)
+    return 0; /* keep serving the current data, if any */
+  if (fstat(fd, &st) < 0 || !changed(db->current, &st)
+      || !(map = calloc(1, sizeof *map))) {
     close(fd);
+    return 0;
+  }
+
+  /* Map, fault in and index the new file before any query can see it. */
+  cdb_init(&map->c, fd);
+  if (map->c.map) {
+    volatile char sum = 0;
+#ifdef MADV_WILLNEED
+    madvise(map->c.map, map->c.size, MADV_WILLNEED);
+#endif
+    for (size_t i = 0; i < map->c.size; i += 4096)
+      sum += map->c.map[i];
+  }
+  prefixes_load(&map->prefix4, &map->c, "\0/4", 4);
+  prefixes_load(&map->prefix6, &map->c, "\0/6", 16);
+  map->legacy = cdb_find(&map->c, "\0/4", 3) == 0
+    && cdb_find(&map->c, "\0/6", 3) == 0;
+  zones_load(&map->zones, &map->c);
+  map->st = st;
+  map->refs = 1;
+  return map;
+}
+
+static void install(struct database *db, struct mapping *map) {
+  map->generation = ++generation;
+  release(db->current);
+  __atomic_store_n(&db->current, map, __ATOMIC_RELEASE);
+}
+
+static void *watch(void *arg) {
+  struct database *db = arg;
+  struct pollfd pfd = { .fd = -1, .events = POLLIN };
+  struct mapping *map;
+  char buffer[4096];
+
+#ifdef __linux__
+  /* Wake whenever a file in the directory is renamed into place or
+     rewritten, then check whether it was ours. */
+  if ((pfd.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) >= 0) {
+    char *dir = strdup(db->filename), *slash = dir ? strrchr(dir, '/') : 0;
+    if (slash)
+      slash[1] = 0;
+    if (!dir || inotify_add_watch(pfd.fd, slash ? dir : ".",
+        IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+      close(pfd.fd);
+      pfd.fd = -1;
+    }
+    free(dir);
+  }
+#endif
+
+  /* Without notification, or in case it misses something such as the
+     directory itself being replaced, fall back to polling with stat. */
+  while (1) {
+    if (poll(&pfd, pfd.fd >= 0, pfd.fd >= 0 ? 10000 : 1000) > 0)
+      while (read(pfd.fd, buffer, sizeof buffer) > 0)
+        continue;
+    if ((map = prepare(db))) {
+      pthread_mutex_lock(&lock);
+      install(db, map);
+      pthread_mutex_unlock(&lock);
+    }
+  }
+  return 0;
+}
+
+static void refresh(struct lookup_ctx *ctx) {
+  struct database *db = ctx->db;
+  struct mapping *map = __atomic_load_n(&db->current, __ATOMIC_ACQUIRE);
 
-  fd = open(filename, O_RDONLY);
-  if (fd >= 0)
-    refreshed = now;
-  cdb_init(&c, fd);
+  /* Contexts on the same database share one mapping, replaced by the
+     watcher thread only when the file changes. Each context holds a
+     reference so a replaced mapping lives until its last user moves on,
+     and the query path only takes the lock when picking up a new one. */
+  if (map != ctx->map) {
+    pthread_mutex_lock(&lock);
+    if ((map = db->current) != ctx->map) {
+      release(ctx->map);
+      if ((ctx->map = map))
+        map->refs++;
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  if (ctx->map)
+    ctx->c = ctx->map->c;
+  else
+    ctx->c = (struct cdb) { .fd = -1 };
 }
 
-static int want(const char *name, const char type[2]) {
-  static stralloc d;
+static int want(struct lookup_ctx *ctx, const char *name,
+    const char type[2]) {
+  stralloc *d = &ctx->owner;
   char buffer[10];
   size_t pos = 12;
+  int seen;
+
+  /* Fall back to scanning the response only if too many distinct
+     records were added to track them all. */
+  if ((seen = response_seen(&ctx->response, name, type)) >= 0)
+    return !seen;
 
-  if (!response_skipname(&pos))
+  if (!response_skipname(&ctx->response, &pos))
     return 1;
   pos += 4;
 
-  while (response_getname(&pos, &d)) {
-    if (!response_copy(&pos, buffer, 10))
+  while (response_getname(&ctx->response, &pos, d)) {
+    if (!response_copy(&ctx->response, &pos, buffer, 10))
       break;
-    if (dns_domain_equal(d.s, name))
+    if (dns_domain_equal(d->s, name))
       if (!memcmp(type, buffer, 2))
         return 0;
     pos += unpack_uint16_big(buffer + 8);
@@ -156,62 +604,68 @@ static int want(const char *name, const char type[2]) {
   return 1;
 }
 
-static int respond(stralloc *qname, const char qtype[2]) {
-  static stralloc name;
+/* Returns -1 if the query was abandoned to shed load. */
+
+static int respond(struct lookup_ctx *ctx, stralloc *qname,
+    const char qtype[2], int shed) {
+  struct response *rs = &ctx->response;
+  stralloc *name = &ctx->name;
   size_t answer, authority, additional;
   int authoritative, nameservers, restarted = 0;
-  int found, gavesoa, rc;
-  char *control, *wild;
+  int found, gavesoa, depth;
+  char *control, *cuts[128], *wild, *type = ctx->type;
+  struct lookup_rrset *zone = &ctx->zone, *set = &ctx->rrset;
+  size_t cutc;
 
   if (!memcmp(qtype, DNS_T_AXFR, 2) || !memcmp(qtype, DNS_T_IXFR, 2)) {
-    response_rcode(RCODE_NOTIMPL);
+    response_rcode(rs, RCODE_NOTIMPL);
     return 1;
   }
 
 ANSWER:
-  answer = response_length();
-  control = qname->s;
+  answer = response_length(rs);
+  cutc = zones_find(ctx, qname->s, cuts);
 
   while (1) {
+    if (cutc == 0) { /* qname is not within our bailiwick */
+      if (!restarted)
+        response_rcode(rs, RCODE_REFUSED);
+      return 1;
+    }
+
     authoritative = 0;
     nameservers = 0;
-    cdb_findstart(&c);
+    control = cuts[--cutc];
+    if (!fetch(ctx, zone, control, 0))
+      return 0;
 
-    while ((rc = find(control, 0))) {
-      if (rc < 0)
-        return 0;
-      if (!memcmp(type, DNS_T_SOA, 2))
+    for (size_t i = 0; i < zone->count; i++) {
+      if (!memcmp(zone->rr[i].type, DNS_T_SOA, 2))
         authoritative++;
-      if (!memcmp(type, DNS_T_NS, 2))
+      if (!memcmp(zone->rr[i].type, DNS_T_NS, 2))
         nameservers++;
     }
 
     if (nameservers > 0)
       break;
-
-    if (!*control) { /* qname is not within our bailiwick */
-      if (!restarted)
-        response_rcode(RCODE_REFUSED);
-      return 1;
-    }
-    control += (uint8_t) *control + 1;
   }
 
   if (!authoritative) {
     if (!restarted)
-      response_authoritative(0);
+      response_authoritative(rs, 0);
     goto AUTHORITY;
   }
 
   found = 0;
   gavesoa = 0;
   wild = qname->s;
+  depth = 0;
 
   while (1) {
-    cdb_findstart(&c);
-    while ((rc = find(wild, wild != qname->s))) {
-      if (rc < 0)
-        return 0;
+    if (!fetch(ctx, set, wild, wild != qname->s))
+      return 0;
+    for (size_t i = 0; i < set->count; i++) {
+      use(ctx, set, i);
       found++;
 
       if (!memcmp(qtype, DNS_T_ANY, 2) && memcmp(type, DNS_T_CNAME, 2))
@@ -221,37 +675,37 @@ ANSWER:
       if (memcmp(type, qtype, 2) && memcmp(type, DNS_T_CNAME, 2))
         continue;
 
-      if (!response_rstart(qname->s, type, ttl))
+      if (!response_rstart(rs, qname->s, type, ctx->ttl))
         return 0;
       if (!memcmp(type, DNS_T_NS, 2) || !memcmp(type, DNS_T_PTR, 2)) {
-        if (!doname(&name))
+        if (!doname(ctx, name))
           return 0;
       } else if (!memcmp(type, DNS_T_CNAME, 2)) {
-        if (!dowild(&name, qname->s, wild - qname->s))
+        if (!dowild(ctx, name, qname->s, wild - qname->s))
           return 0;
         if (memcmp(type, qtype, 2) && ++restarted < 16) {
-          response_rfinish(RESPONSE_ANSWER);
-          if (!dns_domain_copy(qname, name.s))
+          response_rfinish(rs, RESPONSE_ANSWER);
+          if (!dns_domain_copy(qname, name->s))
             return 0;
           goto ANSWER;
         }
       } else if (!memcmp(type, DNS_T_MX, 2)) {
-        if (!dobytes(2))
+        if (!dobytes(ctx, 2))
           return 0;
-        if (!doname(&name))
+        if (!doname(ctx, name))
           return 0;
       } else if (!memcmp(type, DNS_T_SOA, 2)) {
-        if (!doname(&name))
+        if (!doname(ctx, name))
           return 0;
-        if (!doname(&name))
+        if (!doname(ctx, name))
           return 0;
-        if (!dobytes(20))
+        if (!dobytes(ctx, 20))
           return 0;
         gavesoa++;
-      } else if (!dobytes(dlen - dpos)) {
+      } else if (!dobytes(ctx, ctx->dlen - ctx->dpos)) {
         return 0;
       }
-      response_rfinish(RESPONSE_ANSWER);
+      response_rfinish(rs, RESPONSE_ANSWER);
     }
 
     if (found)
@@ -262,145 +716,324 @@ ANSWER:
       break;
 
     if (wild != qname->s) {
-      cdb_findstart(&c);
-      if (find(wild, 0))
+      if (!fetch(ctx, set, wild, 0))
+        return 0;
+      if (set->count > 0)
         break; /* RFC 1034 section 4.3.3 */
     }
+    if (shed && ++depth > LOOKUP_SHED_DEPTH)
+      return -1;
     wild += (uint8_t) *wild + 1;
   }
 
   if (found) {
     if (!memcmp(qtype, DNS_T_ANY, 2)) {
-      if (!response_rstart(qname->s, DNS_T_HINFO, 86400))
+      if (!response_rstart(rs, qname->s, DNS_T_HINFO, 86400))
         return 0;
-      if (!response_addbytes("\7RFC8482\0", 9))
+      if (!response_addbytes(rs, "\7RFC8482\0", 9))
         return 0;
-      response_rfinish(RESPONSE_ANSWER);
+      response_rfinish(rs, RESPONSE_ANSWER);
     }
   } else {
-    response_rcode(RCODE_NXDOMAIN);
+    response_rcode(rs, RCODE_NXDOMAIN);
   }
 
 AUTHORITY:
-  authority = response_length();
+  authority = response_length(rs);
 
   if (authoritative && authority == answer) {
-    cdb_findstart(&c);
-    while ((rc = find(control, 0))) {
-      if (rc < 0)
-        return 0;
+    for (size_t i = 0; i < zone->count; i++) {
+      use(ctx, zone, i);
       if (!memcmp(type, DNS_T_SOA, 2)) {
-        if (!response_rstart(control, DNS_T_SOA, ttl))
+        if (!response_rstart(rs, control, DNS_T_SOA, ctx->ttl))
           return 0;
-        if (!doname(&name))
+        if (!doname(ctx, name))
           return 0;
-        if (!doname(&name))
+        if (!doname(ctx, name))
           return 0;
-        if (!dobytes(20))
+        if (!dobytes(ctx, 20))
           return 0;
-        response_rfinish(RESPONSE_AUTHORITY);
+        response_rfinish(rs, RESPONSE_AUTHORITY);
         break;
       }
     }
   } else if (!authoritative) { /* minimise responses */
-    if (want(control, DNS_T_NS)) {
-      cdb_findstart(&c);
-      while ((rc = find(control, 0))) {
-        if (rc < 0)
-          return 0;
+    if (want(ctx, control, DNS_T_NS)) {
+      for (size_t i = 0; i < zone->count; i++) {
+        use(ctx, zone, i);
         if (!memcmp(type, DNS_T_NS, 2)) {
-          if (!response_rstart(control, DNS_T_NS, ttl))
+          if (!response_rstart(rs, control, DNS_T_NS, ctx->ttl))
             return 0;
-          if (!doname(&name))
+          if (!doname(ctx, name))
             return 0;
-          response_rfinish(RESPONSE_AUTHORITY);
+          response_rfinish(rs, RESPONSE_AUTHORITY);
         }
       }
     }
   }
 
 ADDITIONAL:
-  additional = response_length();
+  additional = response_length(rs);
 
   while (answer < additional) {
     char rtype[2], rdlen[2];
-    stralloc_zero(&name);
+    stralloc_zero(name);
 
-    if (!response_skipname(&answer))
+    if (!response_skipname(rs, &answer))
       return 0;
-    if (!response_copy(&answer, rtype, 2))
+    if (!response_copy(rs, &answer, rtype, 2))
       return 0;
-    if (answer += 6, !response_copy(&answer, rdlen, 2))
+    if (answer += 6, !response_copy(rs, &answer, rdlen, 2))
       return 0;
 
     if (!memcmp(rtype, DNS_T_NS, 2))
-      if (!response_getname(&(size_t) { answer }, &name))
+      if (!response_getname(rs, &(size_t) { answer }, name))
         return 0;
     if (!memcmp(rtype, DNS_T_MX, 2))
-      if (!response_getname(&(size_t) { answer + 2 }, &name))
+      if (!response_getname(rs, &(size_t) { answer + 2 }, name))
         return 0;
     if (!memcmp(rtype, DNS_T_SRV, 2))
-      if (!response_getname(&(size_t) { answer + 6 }, &name))
+      if (!response_getname(rs, &(size_t) { answer + 6 }, name))
         return 0;
 
-    if (name.len > 0) {
-      stralloc_lower(&name);
-      if (want(name.s, DNS_T_A)) {
-        cdb_findstart(&c);
-        while ((rc = find(name.s, 0))) {
-          if (rc < 0)
-            return 0;
+    if (name->len > 0) {
+      stralloc_lower(name);
+      if (!fetch(ctx, set, name->s, 0))
+        return 0;
+      if (want(ctx, name->s, DNS_T_A))
+        for (size_t i = 0; i < set->count; i++) {
+          use(ctx, set, i);
           if (!memcmp(type, DNS_T_A, 2)) {
-            if (!response_rstart(name.s, DNS_T_A, ttl))
+            if (!response_rstart(rs, name->s, DNS_T_A, ctx->ttl))
               return 0;
-            if (!dobytes(4))
+            if (!dobytes(ctx, 4))
               return 0;
-            response_rfinish(RESPONSE_ADDITIONAL);
+            response_rfinish(rs, RESPONSE_ADDITIONAL);
           }
         }
-      }
-      if (want(name.s, DNS_T_AAAA)) {
-        cdb_findstart(&c);
-        while ((rc = find(name.s, 0))) {
-          if (rc < 0)
-            return 0;
+      if (want(ctx, name->s, DNS_T_AAAA))
+        for (size_t i = 0; i < set->count; i++) {
+          use(ctx, set, i);
           if (!memcmp(type, DNS_T_AAAA, 2)) {
-            if (!response_rstart(name.s, DNS_T_AAAA, ttl))
+            if (!response_rstart(rs, name->s, DNS_T_AAAA, ctx->ttl))
               return 0;
-            if (!dobytes(16))
+            if (!dobytes(ctx, 16))
               return 0;
-            response_rfinish(RESPONSE_ADDITIONAL);
+            response_rfinish(rs, RESPONSE_ADDITIONAL);
           }
         }
-      }
     }
     answer += unpack_uint16_big(rdlen);
   }
   return 1;
 }
 
-void lookup(stralloc *r, size_t max, const void *ip, size_t iplen) {
-  static stralloc qname;
+int lookup_ctx_init(struct lookup_ctx *ctx, const char *filename) {
+  struct database *db;
+
+  memset(ctx, 0, sizeof *ctx);
+  pthread_mutex_lock(&lock);
+  for (db = databases; db; db = db->next)
+    if (!strcmp(db->filename, filename))
+      break;
+  if (!db && (db = calloc(1, sizeof *db))) {
+    struct mapping *map;
+
+    if ((db->filename = strdup(filename))) {
+      if ((map = prepare(db)))
+        install(db, map);
+      if (pthread_create(&db->watcher, 0, watch, db) == 0) {
+        pthread_detach(db->watcher);
+        db->next = databases;
+        databases = db;
+      } else {
+        release(db->current);
+        free(db->filename);
+        free(db);
+        db = 0;
+      }
+    } else {
+      free(db);
+      db = 0;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return (ctx->db = db) != 0;
+}
+
+void lookup_ctx_free(struct lookup_ctx *ctx) {
+  pthread_mutex_lock(&lock);
+  release(ctx->map);
+  pthread_mutex_unlock(&lock);
+  ctx->map = 0;
+
+  cache_free(&ctx->cache);
+  stralloc_free(&ctx->key);
+  stralloc_free(&ctx->qname);
+  stralloc_free(&ctx->name);
+  stralloc_free(&ctx->owner);
+  rrset_free(&ctx->zone);
+  rrset_free(&ctx->rrset);
+}
+
+int lookup_ctx_cache(struct lookup_ctx *ctx, size_t entries) {
+  return cache_init(&ctx->cache, entries);
+}
+
+static int cached(struct lookup_ctx *ctx, stralloc *r, const char qtype[2],
+    const char qclass[2]) {
+  stralloc *key = &ctx->key;
+  const char *data;
+  size_t len;
+
+  if (!ctx->map || !ctx->cache.sets)
+    return 0;
+
+  if (!stralloc_copyb(key, ctx->qname.s, ctx->qname.len))
+    return 0;
+  if (!stralloc_catb(key, qtype, 2) || !stralloc_catb(key, qclass, 2))
+    return 0;
+  if (!stralloc_catb(key, ctx->cloc, 2))
+    return 0;
+
+  data = cache_get(&ctx->cache, key->s, key->len, ctx->map->generation,
+    ctx->now, &len);
+  if (!data || len < r->len || !stralloc_ready(r, len))
+    return 0;
+
+  /* Keep the query ID, RD bit and question with its original case. */
+  r->s[2] = (data[2] & ~1) | (r->s[2] & 1);
+  memcpy(r->s + 3, data + 3, 9);
+  memcpy(r->s + r->len, data + r->len, len - r->len);
+  r->len = len;
+  return 1;
+}
+
+static void store(struct lookup_ctx *ctx, stralloc *r) {
+  if (ctx->map && ctx->cache.sets && ctx->now < ctx->expires)
+    cache_put(&ctx->cache, ctx->key.s, ctx->key.len, r->s, r->len,
+      ctx->map->generation, ctx->expires);
+}
+
+/* Cut a response back to its question with TC set, so the client will
+   retry over TCP. */
+
+static void shed(struct lookup_ctx *ctx, stralloc *r, size_t question) {
+  r->len = question;
+  r->s[2] |= 2;
+  r->s[3] &= ~15;
+  memset(r->s + 6, 0, 6);
+  ctx->response.xrcode = 0;
+  ctx->shed++;
+}
+
+static void query(struct lookup_ctx *ctx, stralloc *r, size_t max,
+    const void *ip, size_t iplen, int shedding) {
+  struct response *rs = &ctx->response;
+  stralloc *qname = &ctx->qname;
   char qtype[2], qclass[2];
+  size_t question;
+  int status;
 
-  if (!response_query(r, &qname, qtype, qclass))
+  if (!response_query(rs, r, qname, qtype, qclass)) {
+    response_finish(rs, max);
     return;
+  }
+  question = r->len;
 
   if (!memcmp(qclass, DNS_C_IN, 2)) {
-    response_authoritative(1);
+    response_authoritative(rs, 1);
   } else if (!memcmp(qclass, DNS_C_ANY, 2)) {
-    response_authoritative(0);
+    response_authoritative(rs, 0);
   } else {
-    response_rcode(RCODE_FORMERR);
-    response_finish(max);
+    response_rcode(rs, RCODE_FORMERR);
+    response_finish(rs, max);
     return;
   }
 
-  now = time(0);
-  refresh("data.cdb");
-  stralloc_lower(&qname);
+  stralloc_lower(qname);
+  ctx->zone.valid = ctx->rrset.valid = 0;
+  if (!locate(ctx, ip, iplen)) {
+    response_rcode(rs, RCODE_SERVFAIL);
+  } else if (!cached(ctx, r, qtype, qclass)) {
+    /* When overloaded, turn away queries which are costly to answer
+       but still serve cheap ones and anything already cached. */
+    if (shedding && !memcmp(qtype, DNS_T_ANY, 2)) {
+      shed(ctx, r, question);
+    } else {
+      ctx->expires = -1;
+      if ((status = respond(ctx, qname, qtype, shedding)) < 0)
+        shed(ctx, r, question);
+      else if (status == 0)
+        response_rcode(rs, RCODE_SERVFAIL);
+      else
+        store(ctx, r);
+    }
+    if (shedding && !response_fits(rs, max))
+      shed(ctx, r, question);
+  }
+  response_finish(rs, max);
+}
+
+void lookup_ctx_query(struct lookup_ctx *ctx, stralloc *r, size_t max,
+    const void *ip, size_t iplen) {
+  ctx->now = time(0);
+  refresh(ctx);
+  query(ctx, r, max, ip, iplen, 0);
+}
 
-  if (!locate(ip, iplen) || !respond(&qname, qtype))
-    response_rcode(RCODE_SERVFAIL);
-  response_finish(max);
+/* Copy the question name from a query in lower case, as it is used as
+   a database key, returning its length or 0 if it cannot be parsed. */
+
+static size_t key(const stralloc *packet, char out[255]) {
+  size_t len = 0, pos = 12;
+  uint8_t n;
+
+  while (pos < packet->len) {
+    n = packet->s[pos];
+    if (n == 0) {
+      out[len++] = 0;
+      return len;
+    }
+    if (n > 63 || len + n + 1 >= 255 || packet->len - pos <= n)
+      return 0;
+    out[len++] = n;
+    for (pos++; n > 0; n--, pos++) {
+      char c = packet->s[pos];
+      out[len++] = c >= 'A' && c <= 'Z' ? c + 32 : c;
+    }
+  }
+  return 0;
+}
+
+/* Answer a batch in groups, first walking every query in a group through
+   each dependent step of its cdb lookup, prefetching the next. The header
+   slot, hash slot and record of each name are then usually in cache by
+   the time the group is answered, their misses having overlapped. */
+
+void lookup_ctx_batch(struct lookup_ctx *ctx, struct lookup_query *q,
+    size_t count) {
+  struct cdb_probe probe[LOOKUP_PREFETCH];
+  char name[255];
+  size_t group, len;
+
+  ctx->now = time(0);
+  refresh(ctx);
+
+  for (size_t i = 0; i < count; i += group) {
+    group = count - i < LOOKUP_PREFETCH ? count - i : LOOKUP_PREFETCH;
+    if (ctx->map && group > 1) {
+      for (size_t j = 0; j < group; j++) {
+        len = key(&q[i + j].packet, name);
+        cdb_prefetch(&ctx->c, probe + j, name, len);
+      }
+      for (size_t j = 0; j < group; j++)
+        cdb_prefetchnext(&ctx->c, probe + j);
+      for (size_t j = 0; j < group; j++)
+        cdb_prefetchnext(&ctx->c, probe + j);
+    }
+
+    for (size_t j = i; j < i + group; j++)
+      query(ctx, &q[j].packet, q[j].max, q[j].ip, q[j].iplen, q[j].shed);
+  }
 }
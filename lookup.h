@@ -0,0 +1,77 @@
+#ifndef LOOKUP_H
+#define LOOKUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "cache.h"
+#include "cdb/cdb.h"
+#include "response.h"
+#include "stralloc.h"
+
+#define LOOKUP_PREFETCH 8 /* queries whose cdb lookups are overlapped */
+#define LOOKUP_SHED_DEPTH 2 /* wildcard levels searched while shedding */
+
+struct database;
+struct mapping;
+
+struct lookup_rr {
+  size_t pos;
+  size_t len;
+  uint32_t ttl;
+  char type[2];
+};
+
+struct lookup_rrset {
+  stralloc name, data;
+  const char *base;
+  struct lookup_rr *rr;
+  size_t count;
+  size_t size;
+  int valid;
+  int wild;
+};
+
+struct lookup_ctx {
+  struct database *db;
+  struct mapping *map;
+  struct cdb c;
+  char cloc[2];
+  uint64_t now;
+
+  const char *data;
+  size_t dlen;
+  size_t dpos;
+
+  uint64_t expires;
+  uint64_t ttd;
+  uint32_t ttl;
+  char type[2];
+
+  stralloc key, qname, name, owner;
+  struct lookup_rrset zone, rrset;
+  struct response response;
+  struct cache cache;
+  uint64_t shed; /* responses cut to a bare TC while overloaded */
+};
+
+struct lookup_query {
+  stralloc packet;
+  size_t max;
+  const void *ip;
+  size_t iplen;
+  int shed; /* turn away expensive queries with TC */
+};
+
+/* Responses are limited to 512 bytes, or to the payload size advertised
+   in an EDNS query, capped at max. A max of -1 is for stream transports,
+   where responses are never truncated. */
+
+int lookup_ctx_init(struct lookup_ctx *ctx, const char *filename);
+void lookup_ctx_free(struct lookup_ctx *ctx);
+int lookup_ctx_cache(struct lookup_ctx *ctx, size_t entries);
+void lookup_ctx_query(struct lookup_ctx *ctx, stralloc *r, size_t max,
+  const void *ip, size_t iplen);
+void lookup_ctx_batch(struct lookup_ctx *ctx, struct lookup_query *q,
+  size_t count);
+
+#endif
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "lookup.h"
+#include "rrl.h"
+#include "scan.h"
+#include "server.h"
+#include "stralloc.h"
+#include "tcp.h"
+#include "udp.h"
+
+/* Each worker answers datagrams and streams from one event loop with a
+   single lookup context, so both transports share its response cache. */
+
+struct worker {
+  pthread_t thread;
+  int cpu;
+  int fd[16];
+  size_t fdc;
+
+  struct udp udp;
+  struct tcp tcp;
+  struct lookup_ctx lookup;
+};
+
+static struct worker *worker;
+static size_t workers = 1, batch = 32, limit = 256;
+static size_t payload = RESPONSE_PAYLOAD;
+static uint32_t defer, fastopen, rate, slip = 2;
+static int pin, filter, steer;
+
+const char options[] = "a:b:e:j:l:npqr:s:t:";
+const char optionhelp[] = "\
+  -a SECS       defer accepting each stream for up to SECS until a query\n\
+                arrives\n\
+  -b COUNT      receive and answer up to COUNT queries per system call\n\
+  -e SIZE       answer EDNS queries with up to SIZE bytes (default 1232)\n\
+  -j COUNT      serve queries from COUNT threads with separate sockets\n\
+  -l SLIP       send every SLIP-th response over the rate limit truncated\n\
+                instead of dropping it, or none if 0 (default 2)\n\
+  -n            steer each query name to the same thread\n\
+  -p            pin each thread to a different CPU\n\
+  -q            discard datagrams which are not queries in the kernel\n\
+  -r RATE       send each client network up to RATE responses per second\n\
+                of each kind over UDP\n\
+  -s COUNT      serve up to COUNT concurrent query streams (default 256)\n\
+  -t COUNT      accept queries in TCP Fast Open SYNs, with up to COUNT\n\
+                pending\n\
+";
+
+int configure(int option, const char *arg) {
+  uint32_t u;
+
+  switch (option) {
+    case 'a':
+      if (scan_uint32(arg, &defer) != strlen(arg) || defer == 0)
+        errx(1, "Invalid accept delay: %s", arg);
+      return 1;
+    case 'b':
+      if (scan_uint32(arg, &u) != strlen(arg) || u == 0 || u > 1024)
+        errx(1, "Invalid batch size: %s", arg);
+      batch = u;
+      return 1;
+    case 'e':
+      if (scan_uint32(arg, &u) != strlen(arg) || u < 512 || u > 65535)
+        errx(1, "Invalid EDNS payload size: %s", arg);
+      payload = u;
+      return 1;
+    case 'j':
+      if (scan_uint32(arg, &u) != strlen(arg) || u == 0 || u > 1024)
+        errx(1, "Invalid thread count: %s", arg);
+      workers = u;
+      return 1;
+    case 'l':
+      if (scan_uint32(arg, &slip) != strlen(arg))
+        errx(1, "Invalid slip ratio: %s", arg);
+      return 1;
+    case 'n':
+      steer = 1;
+      return 1;
+    case 'p':
+#ifndef CPU_SET
+      errx(1, "CPU pinning is not supported on this platform");
+#endif
+      pin = 1;
+      return 1;
+    case 'q':
+      filter = 1;
+      return 1;
+    case 'r':
+      if (scan_uint32(arg, &rate) != strlen(arg) || rate == 0
+            || rate > RRL_RATE)
+        errx(1, "Invalid response rate: %s", arg);
+      return 1;
+    case 's':
+      if (scan_uint32(arg, &u) != strlen(arg) || u == 0)
+        errx(1, "Invalid stream count: %s", arg);
+      limit = u;
+      return 1;
+    case 't':
+      if (scan_uint32(arg, &fastopen) != strlen(arg) || fastopen == 0)
+        errx(1, "Invalid Fast Open queue length: %s", arg);
+      return 1;
+  }
+  return 0;
+}
+
+void attach(const char *address, const char *port) {
+  struct addrinfo hints = { .ai_socktype = SOCK_DGRAM }, *info, *list;
+  int status = getaddrinfo(address, port, &hints, &list);
+
+  if (status != 0 || list == 0)
+    errx(1, "getaddrinfo %s: %s", address, gai_strerror(status));
+  if (!worker && !(worker = calloc(workers, sizeof *worker)))
+    err(1, "calloc");
+
+  /* Each worker has its own datagram socket and listener for every
+     address, relying on SO_REUSEPORT to share queries between them. */
+  for (info = list; info; info = info->ai_next) {
+    struct addrinfo stream = *info;
+    stream.ai_socktype = SOCK_STREAM;
+    stream.ai_protocol = 0;
+
+    for (struct worker *w = worker; w < worker + workers; w++) {
+      if (w->fdc >= sizeof w->fd / sizeof *w->fd)
+        errx(1, "Too many listening addresses");
+      w->fd[w->fdc] = udp_socket(info);
+      if (filter)
+        udp_filter(w->fd[w->fdc]);
+      w->fdc++;
+      tcp_listen(&w->tcp, tcp_socket(&stream, defer, fastopen));
+    }
+    if (steer)
+      udp_steer(worker->fd[worker->fdc - 1], workers);
+  }
+  freeaddrinfo(list);
+}
+
+static void statistics(void) {
+  uint64_t hits = 0, misses = 0, truncated = 0, avoided = 0, dropped = 0;
+  uint64_t limited = 0, slipped = 0;
+
+  for (struct worker *w = worker; w < worker + workers; w++) {
+    hits += w->lookup.cache.hits;
+    misses += w->lookup.cache.misses;
+    truncated += w->lookup.response.truncated;
+    avoided += w->lookup.response.avoided;
+    if (w->udp.rrl) {
+      limited += w->udp.rrl->dropped;
+      slipped += w->udp.rrl->slipped;
+    }
+    for (size_t i = 0; i < w->fdc; i++)
+      dropped += udp_drops(w->fd[i]);
+  }
+  fprintf(stderr, "cache-hits=%" PRIu64 " cache-misses=%" PRIu64
+    " truncated=%" PRIu64 " truncation-avoided=%" PRIu64
+    " kernel-dropped=%" PRIu64 " rate-limited=%" PRIu64
+    " slipped=%" PRIu64 "\n", hits, misses, truncated, avoided, dropped,
+    limited, slipped);
+}
+
+static void *run(void *arg) {
+  void *ready[TCP_EVENTS];
+  struct worker *w = arg;
+  size_t count, streams;
+
+#ifdef CPU_SET
+  if (pin) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+  }
+#endif
+
+  while (1) {
+    if (__atomic_exchange_n(&reporting, 0, __ATOMIC_RELAXED))
+      statistics();
+
+    count = tcp_wait(&w->tcp, ready);
+
+    /* Answer datagrams straight away and pass the rest to tcp_events(). */
+    streams = 0;
+    for (size_t i = 0; i < count; i++) {
+      int *fd = ready[i];
+      if (fd >= w->fd && fd < w->fd + w->fdc)
+        udp_receive(&w->udp, *fd);
+      else
+        ready[streams++] = ready[i];
+    }
+    tcp_events(&w->tcp, ready, streams);
+  }
+  return 0;
+}
+
+void serve() {
+  int cpu = -1;
+#ifdef CPU_SET
+  cpu_set_t set;
+
+  if (pin && sched_getaffinity(0, sizeof set, &set) < 0)
+    err(1, "sched_getaffinity");
+#endif
+
+  for (struct worker *w = worker; w < worker + workers; w++) {
+    if (!lookup_ctx_init(&w->lookup, "data.cdb"))
+      err(1, "malloc");
+    if (!lookup_ctx_cache(&w->lookup, cachesize))
+      err(1, "malloc");
+    if (!udp_init(&w->udp, &w->lookup, batch, payload))
+      err(1, "malloc");
+    if (rate && !udp_limit(&w->udp, w > worker ? &worker->udp : 0, rate,
+          slip))
+      err(1, "malloc");
+
+    /* Share the stream limit between workers, rounding up. */
+    tcp_init(&w->tcp, &w->lookup, (limit + workers - 1) / workers);
+    for (size_t i = 0; i < w->fdc; i++)
+      tcp_watch(&w->tcp, w->fd[i], w->fd + i);
+
+#ifdef CPU_SET
+    /* Assign CPUs round-robin from those we are allowed to use. */
+    if (pin)
+      do
+        cpu = (cpu + 1) % CPU_SETSIZE;
+      while (!CPU_ISSET(cpu, &set));
+#endif
+    w->cpu = cpu;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  for (struct worker *w = worker + 1; w < worker + workers; w++)
+    if ((errno = pthread_create(&w->thread, 0, run, w)))
+      err(1, "pthread_create");
+  run(worker);
+}
@@ -5,79 +5,244 @@
 #include "pack.h"
 #include "response.h"
 
-static stralloc *response = &(stralloc) {
-  .limit = -1
-};
-
-static struct {
-  char s[128];
-  uint16_t pos;
-} name[128];
-
-static size_t namec;
-static size_t rdata;
-
-int response_addbytes(const char *in, unsigned int len) {
-  return stralloc_catb(response, in, len);
+int response_addbytes(struct response *rs, const char *in, unsigned int len) {
+  return stralloc_catb(rs->packet, in, len);
 }
 
-int response_addshort(uint16_t u) {
+int response_addshort(struct response *rs, uint16_t u) {
   char buffer[2];
 
   pack_uint16_big(buffer, u);
-  return response_addbytes(buffer, 2);
+  return response_addbytes(rs, buffer, 2);
 }
 
-int response_addlong(uint32_t u) {
+int response_addlong(struct response *rs, uint32_t u) {
   char buffer[4];
 
   pack_uint32_big(buffer, u);
-  return response_addbytes(buffer, 4);
+  return response_addbytes(rs, buffer, 4);
 }
 
-int response_addname(const char *d) {
-  size_t dlen = dns_domain_length(d), i;
+static uint32_t response_hash(const char *label, uint16_t parent) {
+  uint32_t h = 5381 + parent;
 
-  while (*d) {
-    for (i = 0; i < namec; i++)
-      if (dns_domain_equal(d, name[i].s))
-        return response_addshort(49152 + name[i].pos);
-    if (dlen <= 128 && response->len < 16384)
-      if (namec < sizeof name / sizeof *name) {
-        memcpy(name[namec].s, d, dlen);
-        name[namec].pos = response->len;
-        namec++;
-      }
-    i = (uint8_t) *d + 1;
-    if (!response_addbytes(d, i))
+  for (size_t i = 0; i <= (uint8_t) *label; i++) {
+    uint8_t c = label[i] >= 'A' && label[i] <= 'Z' ? label[i] + 32 : label[i];
+    h = (h + (h << 5)) ^ c;
+  }
+  return h;
+}
+
+static int response_label(struct response *rs, size_t pos,
+    const char *label) {
+  const char *s = rs->packet->s + pos;
+
+  for (size_t i = 0; i <= (uint8_t) *label; i++) {
+    uint8_t x = s[i] >= 'A' && s[i] <= 'Z' ? s[i] + 32 : s[i];
+    uint8_t y = label[i] >= 'A' && label[i] <= 'Z' ? label[i] + 32 : label[i];
+    if (x != y) /* safe because 63 < 'A' */
       return 0;
-    d += i, dlen -= i;
   }
-  return response_addbytes(d, 1);
+  return 1;
+}
+
+static uint16_t response_find(struct response *rs, const char *label,
+    uint16_t parent, uint32_t h) {
+  size_t i = h % RESPONSE_SLOTS;
+
+  for (uint16_t n; (n = rs->slot[i]); i = (i + 1) % RESPONSE_SLOTS)
+    if (rs->name[n - 1].hash == h && rs->name[n - 1].parent == parent)
+      if (response_label(rs, rs->name[n - 1].pos, label))
+        return n;
+  return 0;
+}
+
+static uint16_t response_insert(struct response *rs, size_t pos,
+    uint16_t parent, uint32_t h) {
+  size_t i = h % RESPONSE_SLOTS;
+
+  if (rs->namec >= RESPONSE_NAMES)
+    return 0;
+  while (rs->slot[i])
+    i = (i + 1) % RESPONSE_SLOTS;
+  rs->name[rs->namec].hash = h;
+  rs->name[rs->namec].pos = pos;
+  rs->name[rs->namec].parent = parent;
+  rs->name[rs->namec].slot = i;
+  return rs->slot[i] = ++rs->namec;
+}
+
+int response_addname(struct response *rs, const char *d) {
+  const char *label[128];
+  uint16_t id[129] = { 0 };
+  size_t count = 0, start = rs->packet->len, k, m;
+
+  for (const char *s = d; *s; s += (uint8_t) *s + 1)
+    if (count < 127)
+      label[count++] = s;
+
+  /* Each recorded label is identified by its text and the entry for the
+     rest of its name, so match the longest known suffix from the root. */
+  for (m = count; m > 0; m--) {
+    uint32_t h = response_hash(label[m - 1], id[m]);
+    if (!(id[m - 1] = response_find(rs, label[m - 1], id[m], h)))
+      break;
+  }
+
+  /* Point at the longest matched suffix within pointer range and write
+     the labels before it, recording any that are new to this response
+     as long as the name starts within range. */
+  for (k = m; k < count; k++)
+    if (rs->name[id[k] - 1].pos < 16384)
+      break;
+
+  if (start < 16384)
+    for (size_t i = m; i-- > 0; ) {
+      uint32_t h = response_hash(label[i], id[i + 1]);
+      if (!id[i + 1] && i + 1 < count)
+        break;
+      id[i] = response_insert(rs, start + (label[i] - d), id[i + 1], h);
+    }
+
+  if (k == count)
+    return response_addbytes(rs, d, dns_domain_length(d));
+  if (!response_addbytes(rs, d, label[k] - d))
+    return 0;
+  return response_addshort(rs, 49152 + rs->name[id[k] - 1].pos);
+}
+
+size_t response_length(struct response *rs) {
+  return rs->packet->len;
+}
+
+int response_copy(struct response *rs, size_t *pos, char *out, size_t len) {
+  return dns_packet_copy(pos, out, len, rs->packet->s, rs->packet->len);
+}
+
+int response_getname(struct response *rs, size_t *pos, stralloc *d) {
+  return dns_packet_getname(pos, d, rs->packet->s, rs->packet->len);
+}
+
+int response_skipname(struct response *rs, size_t *pos) {
+  return dns_packet_skipname(pos, rs->packet->s, rs->packet->len);
+}
+
+static uint32_t response_rrhash(const char *d, const char type[2]) {
+  uint32_t h = 5381;
+
+  for (size_t i = 0; i < dns_domain_length(d); i++) {
+    uint8_t c = d[i] >= 'A' && d[i] <= 'Z' ? d[i] + 32 : d[i];
+    h = (h + (h << 5)) ^ c;
+  }
+  h = (h + (h << 5)) ^ (uint8_t) type[0];
+  return (h + (h << 5)) ^ (uint8_t) type[1];
 }
 
-size_t response_length(void) {
-  return response->len;
+static int response_equal(struct response *rs, size_t pos, const char *d) {
+  const char *s = rs->packet->s;
+  size_t len = rs->packet->len;
+
+  /* Compare the owner of a record we wrote ourselves, so every pointer
+     leads backwards and the name is well formed. */
+  while (pos < len) {
+    if ((uint8_t) s[pos] >= 192) {
+      pos = ((uint8_t) s[pos] & 63) << 8 | (uint8_t) s[pos + 1];
+      continue;
+    }
+    for (size_t i = 0; i <= (uint8_t) *d; i++) {
+      uint8_t x = s[pos + i] >= 'A' && s[pos + i] <= 'Z' ? s[pos + i] + 32
+        : s[pos + i];
+      uint8_t y = d[i] >= 'A' && d[i] <= 'Z' ? d[i] + 32 : d[i];
+      if (x != y) /* safe because 63 < 'A' */
+        return 0;
+    }
+    if (!*d)
+      return 1;
+    pos += (uint8_t) *d + 1;
+    d += (uint8_t) *d + 1;
+  }
+  return 0;
 }
 
-int response_copy(size_t *pos, char *out, size_t len) {
-  return dns_packet_copy(pos, out, len, response->s, response->len);
+int response_seen(struct response *rs, const char *d, const char type[2]) {
+  uint32_t h = response_rrhash(d, type);
+  size_t i = h % RESPONSE_RRSLOTS;
+
+  for (uint16_t n; (n = rs->rrslot[i]); i = (i + 1) % RESPONSE_RRSLOTS)
+    if (rs->rrset[n - 1].hash == h && !memcmp(rs->rrset[n - 1].type, type, 2))
+      if (response_equal(rs, rs->rrset[n - 1].pos, d))
+        return 1;
+  return rs->rrsetfull ? -1 : 0;
 }
 
-int response_getname(size_t *pos, stralloc *d) {
-  return dns_packet_getname(pos, d, response->s, response->len);
+static void response_record(struct response *rs, const char *d,
+    const char type[2], size_t pos) {
+  uint32_t h = response_rrhash(d, type);
+  size_t i = h % RESPONSE_RRSLOTS;
+
+  if (response_seen(rs, d, type) > 0)
+    return;
+  if (rs->rrsetc >= RESPONSE_RRSETS || pos > UINT16_MAX) {
+    rs->rrsetfull = 1;
+    return;
+  }
+  while (rs->rrslot[i])
+    i = (i + 1) % RESPONSE_RRSLOTS;
+  rs->rrset[rs->rrsetc].hash = h;
+  rs->rrset[rs->rrsetc].pos = pos;
+  rs->rrset[rs->rrsetc].slot = i;
+  memcpy(rs->rrset[rs->rrsetc].type, type, 2);
+  rs->rrslot[i] = ++rs->rrsetc;
 }
 
-int response_skipname(size_t *pos) {
-  return dns_packet_skipname(pos, response->s, response->len);
+/* Look for an OPT record following the question, returning 0 if the
+   additional section is malformed or has more than one of them, and -1
+   if the client asks for an EDNS version we do not support. */
+
+static int response_opt(struct response *rs, size_t pos) {
+  const char *s = rs->packet->s;
+  size_t len = rs->packet->len;
+  char rr[10];
+
+  if (memcmp(s + 6, "\0\0\0\0", 4))
+    return 1; /* only plain queries are expected to carry OPT */
+
+  for (uint16_t n = unpack_uint16_big(s + 10); n > 0; n--) {
+    size_t start = pos;
+    if (!dns_packet_skipname(&pos, s, len))
+      return 0;
+    if (!dns_packet_copy(&pos, rr, 10, s, len))
+      return 0;
+    if (!memcmp(rr, DNS_T_OPT, 2)) {
+      if (rs->edns || pos != start + 11)
+        return 0; /* repeated, or not owned by the root */
+      rs->edns = 1;
+      rs->payload = unpack_uint16_big(rr + 2);
+      rs->dnssec = rr[6] & 128;
+      if (rr[5])
+        return -1;
+    }
+    pos += unpack_uint16_big(rr + 8);
+    if (pos > len)
+      return 0;
+  }
+  return 1;
 }
 
-int response_query(stralloc *r, stralloc *qname, char qtype[2],
-    char qclass[2]) {
+int response_query(struct response *rs, stralloc *r, stralloc *qname,
+    char qtype[2], char qclass[2]) {
   size_t pos = 12;
+  int status;
 
-  response = r;
-  namec = rdata = 0;
+  rs->packet = r;
+  while (rs->namec > 0)
+    rs->slot[rs->name[--rs->namec].slot] = 0;
+  while (rs->rrsetc > 0)
+    rs->rrslot[rs->rrset[--rs->rrsetc].slot] = 0;
+  rs->rrsetfull = 0;
+  rs->rdata = 0;
+  rs->edns = rs->dnssec = 0;
+  rs->xrcode = 0;
 
   if (r->len < 12 || r->s[2] & 128) {
     r->len = 0;
@@ -85,91 +250,217 @@ int response_query(stralloc *r, stralloc *qname, char qtype[2],
   }
 
   if (r->s[2] & 254) /* not a standard query */
-    return response_rcode(RCODE_NOTIMPL), 0;
+    return response_rcode(rs, RCODE_NOTIMPL), 0;
 
   if (memcmp(r->s + 4, "\0\1", 2)) /* QDCOUNT != 1 */
-    return response_rcode(RCODE_FORMERR), 0;
+    return response_rcode(rs, RCODE_FORMERR), 0;
   if (!dns_packet_getname(&pos, qname, r->s, r->len))
-    return response_rcode(RCODE_FORMERR), 0;
+    return response_rcode(rs, RCODE_FORMERR), 0;
   if (!dns_packet_copy(&pos, qtype, 2, r->s, r->len))
-    return response_rcode(RCODE_FORMERR), 0;
+    return response_rcode(rs, RCODE_FORMERR), 0;
   if (!dns_packet_copy(&pos, qclass, 2, r->s, r->len))
-    return response_rcode(RCODE_FORMERR), 0;
+    return response_rcode(rs, RCODE_FORMERR), 0;
+  if ((status = response_opt(rs, pos)) <= 0)
+    return response_rcode(rs, status ? RCODE_BADVERS : RCODE_FORMERR), 0;
 
   r->len = 12; /* inherit ID, RD and QDCOUNT */
   memset(r->s + 6, 0, 6); /* ANCOUNT, NSCOUNT, ARCOUNT */
 
-  if (!response_addname(qname->s))
-    return response_rcode(RCODE_SERVFAIL), 0;
-  if (!response_addbytes(qtype, 2))
-    return response_rcode(RCODE_SERVFAIL), 0;
-  if (!response_addbytes(qclass, 2))
-    return response_rcode(RCODE_SERVFAIL), 0;
+  if (!response_addname(rs, qname->s))
+    return response_rcode(rs, RCODE_SERVFAIL), 0;
+  if (!response_addbytes(rs, qtype, 2))
+    return response_rcode(rs, RCODE_SERVFAIL), 0;
+  if (!response_addbytes(rs, qclass, 2))
+    return response_rcode(rs, RCODE_SERVFAIL), 0;
 
-  response_rcode(RCODE_NOERROR);
+  response_rcode(rs, RCODE_NOERROR);
   return 1;
 }
 
-void response_authoritative(int flag) {
-  response->s[2] &= ~4;
+void response_authoritative(struct response *rs, int flag) {
+  rs->packet->s[2] &= ~4;
   if (flag)
-    response->s[2] |= 4;
+    rs->packet->s[2] |= 4;
 }
 
-void response_rcode(uint8_t rcode) {
+void response_rcode(struct response *rs, uint8_t rcode) {
   if (rcode == RCODE_FORMERR
         || rcode == RCODE_SERVFAIL
         || rcode == RCODE_NOTIMPL
-        || rcode == RCODE_REFUSED) {
+        || rcode == RCODE_REFUSED
+        || rcode == RCODE_BADVERS) {
     size_t pos = 12;
-    response->s[2] &= ~4; /* AA = 0 */
+    rs->packet->s[2] &= ~4; /* AA = 0 */
 
-    if (!memcmp(response->s + 4, "\0\1", 2)
-          && response_skipname(&pos)
-          && response->len >= pos + 4) {
-      memset(response->s + 6, 0, 6);
-      response->len = pos + 4;
+    if (!memcmp(rs->packet->s + 4, "\0\1", 2)
+          && response_skipname(rs, &pos)
+          && rs->packet->len >= pos + 4) {
+      memset(rs->packet->s + 6, 0, 6);
+      rs->packet->len = pos + 4;
     } else {
-      memset(response->s + 4, 0, 8);
-      response->len = 12;
+      memset(rs->packet->s + 4, 0, 8);
+      rs->packet->len = 12;
     }
   }
-  response->s[2] |= 128; /* QR = 1 */
-  response->s[3] = rcode;
+  rs->packet->s[2] |= 128; /* QR = 1 */
+  rs->packet->s[3] = rcode & 15;
+  rs->xrcode = rcode >> 4;
 }
 
-int response_rstart(const char *d, const char type[2], uint32_t ttl) {
-  if (!response_addname(d))
+int response_rstart(struct response *rs, const char *d, const char type[2],
+    uint32_t ttl) {
+  size_t pos = rs->packet->len;
+
+  if (!response_addname(rs, d))
     return 0;
-  if (!response_addbytes(type, 2))
+  response_record(rs, d, type, pos);
+  if (!response_addbytes(rs, type, 2))
     return 0;
-  if (!response_addbytes(DNS_C_IN, 2))
+  if (!response_addbytes(rs, DNS_C_IN, 2))
     return 0;
-  if (!response_addlong(ttl))
+  if (!response_addlong(rs, ttl))
     return 0;
-  if (!response_addbytes("\0\0", 2))
+  if (!response_addbytes(rs, "\0\0", 2))
     return 0;
-  rdata = response->len;
+  rs->rdata = rs->packet->len;
   return 1;
 }
 
-void response_rfinish(size_t section) {
-  pack_uint16_big(response->s + rdata - 2, response->len - rdata);
-  if (!++response->s[section + 1])
-    response->s[section]++;
-  rdata = 0;
+void response_rfinish(struct response *rs, size_t section) {
+  pack_uint16_big(rs->packet->s + rs->rdata - 2, rs->packet->len - rs->rdata);
+  if (!++rs->packet->s[section + 1])
+    rs->packet->s[section]++;
+  rs->rdata = 0;
 }
 
-void response_finish(size_t len) {
-  if (len < response->len) {
-    size_t pos = 12;
-    if (response_skipname(&pos) && len >= pos + 4) {
-      memset(response->s + 6, 0, 6);
-      response->len = pos + 4;
+static int response_same(struct response *rs, size_t a, size_t b) {
+  const char *s = rs->packet->s;
+
+  /* Both names are in a response we wrote, as with response_equal(). */
+  while (1) {
+    while ((uint8_t) s[a] >= 192)
+      a = ((uint8_t) s[a] & 63) << 8 | (uint8_t) s[a + 1];
+    while ((uint8_t) s[b] >= 192)
+      b = ((uint8_t) s[b] & 63) << 8 | (uint8_t) s[b + 1];
+    for (size_t i = 0; i <= (uint8_t) s[a]; i++) {
+      uint8_t x = s[a + i] >= 'A' && s[a + i] <= 'Z' ? s[a + i] + 32 : s[a + i];
+      uint8_t y = s[b + i] >= 'A' && s[b + i] <= 'Z' ? s[b + i] + 32 : s[b + i];
+      if (x != y)
+        return 0;
+    }
+    if (!s[a])
+      return 1;
+    a += (uint8_t) s[a] + 1;
+    b += (uint8_t) s[b] + 1;
+  }
+}
+
+/* Find the last RRset boundary at which the response can be cut to fit
+   in limit, returning the number of records kept in each section before
+   it, or 0 if the answer section would not survive intact. */
+
+static size_t response_cut(struct response *rs, size_t limit,
+    uint16_t kept[3]) {
+  uint16_t count[3], n[3] = { 0 };
+  size_t cut = 0, owner = 0, pos = 12, section = 0, start;
+  char rr[10], type[2];
+
+  for (int i = 0; i < 3; i++)
+    count[i] = unpack_uint16_big(rs->packet->s + 6 + 2 * i);
+  if (!response_skipname(rs, &pos) || (pos += 4) > rs->packet->len)
+    return 0;
+
+  while ((start = pos) <= limit) {
+    while (section < 3 && n[section] == count[section])
+      section++;
+    if (section == 3)
+      break;
+
+    if (!response_skipname(rs, &pos) || !response_copy(rs, &pos, rr, 10))
+      return 0;
+
+    /* Each section start and change of owner or type begins an RRset. */
+    if (n[section] == 0 || memcmp(rr, type, 2) || !response_same(rs, owner,
+          start))
+      if (n[0] == count[0]) {
+        memcpy(kept, n, sizeof n);
+        cut = start;
+      }
+
+    memcpy(type, rr, 2);
+    owner = start;
+    if ((pos += unpack_uint16_big(rr + 8)) > rs->packet->len)
+      return 0;
+    n[section]++;
+  }
+  return cut;
+}
+
+/* The payload size the client advertised, capped at max, or 512 bytes
+   without EDNS. A max of -1 is for streams, which are never truncated. */
+
+size_t response_limit(struct response *rs, size_t max) {
+  size_t limit = rs->edns && rs->payload > 512 ? rs->payload : 512;
+
+  return max == (size_t) -1 || limit > max ? max : limit;
+}
+
+/* Whether the response can be made to fit within its limit by dropping
+   authority and additional records, rather than cut to a bare question. */
+
+int response_fits(struct response *rs, size_t max) {
+  size_t limit = response_limit(rs, max), opt = rs->edns ? 11 : 0;
+  uint16_t kept[3];
+
+  return rs->packet->len + opt <= limit
+    || response_cut(rs, limit - opt, kept) > 0;
+}
+
+/* Fit the response within its limit, then append an OPT record if the
+   query had one. */
+
+void response_finish(struct response *rs, size_t max) {
+  size_t cut, len = rs->packet->len, limit = response_limit(rs, max);
+  size_t opt = rs->edns ? 11 : 0, pos = 12;
+  char *s = rs->packet->s;
+  uint16_t kept[3];
+
+  if (len < 12)
+    return;
+
+  /* Drop whole RRsets from the additional section, then the authority
+     section, but never part of the answer. Only missing authority
+     records need TC, as additional records are optional. */
+  if (len + opt > limit) {
+    if ((cut = response_cut(rs, limit - opt, kept))) {
+      if (kept[1] < unpack_uint16_big(s + 8))
+        s[2] |= 2;
+      for (int i = 0; i < 3; i++)
+        pack_uint16_big(s + 6 + 2 * i, kept[i]);
+      rs->packet->len = cut;
+    } else if (response_skipname(rs, &pos) && limit >= pos + 4 + opt) {
+      memset(s + 6, 0, 6);
+      rs->packet->len = pos + 4;
+      s[2] |= 2;
     } else {
-      memset(response->s + 4, 0, 8);
-      response->len = 12;
+      memset(s + 4, 0, 8);
+      rs->packet->len = 12;
+      s[2] |= 2;
     }
-    response->s[2] |= 2;
+    if (s[2] & 2)
+      rs->truncated++;
+  }
+
+  if (max != (size_t) -1 && len > 512 && !(s[2] & 2))
+    rs->avoided++;
+
+  if (rs->edns) {
+    char rr[11] = { 0, 0, 41 };
+    pack_uint16_big(rr + 3, max <= 65535 ? max : RESPONSE_PAYLOAD);
+    rr[5] = rs->xrcode;
+    rr[7] = rs->dnssec ? 128 : 0;
+    if (response_addbytes(rs, rr, 11))
+      pack_uint16_big(rs->packet->s + 10,
+        unpack_uint16_big(rs->packet->s + 10) + 1);
   }
 }
@@ -16,23 +16,65 @@
 #define RCODE_NXDOMAIN 3
 #define RCODE_NOTIMPL 4
 #define RCODE_REFUSED 5
+#define RCODE_BADVERS 16 /* extended, carried partly in OPT */
 
-int response_addbytes(const char *buf, unsigned int len);
-int response_addshort(uint16_t u);
-int response_addlong(uint32_t u);
-int response_addname(const char *d);
-
-size_t response_length(void);
-int response_copy(size_t *pos, char *out, size_t len);
-int response_getname(size_t *pos, stralloc *d);
-int response_skipname(size_t *pos);
-
-int response_query(stralloc *r, stralloc *qname, char qtype[2],
-  char qclass[2]);
-void response_authoritative(int flag);
-void response_rcode(uint8_t rcode);
-int response_rstart(const char *d, const char type[2], uint32_t ttl);
-void response_rfinish(size_t section);
-void response_finish(size_t maxlen);
+#define RESPONSE_PAYLOAD 1232 /* default EDNS payload limit */
+
+#define RESPONSE_NAMES 1024 /* labels recorded for compression */
+#define RESPONSE_SLOTS 2048
+#define RESPONSE_RRSETS 1024 /* owner and type pairs recorded */
+#define RESPONSE_RRSLOTS 2048
+
+struct response {
+  stralloc *packet;
+  struct {
+    uint32_t hash;
+    uint16_t pos;
+    uint16_t parent; /* 0 for the root, else index + 1 */
+    uint16_t slot;
+  } name[RESPONSE_NAMES];
+  uint16_t slot[RESPONSE_SLOTS]; /* 0 if empty, else index + 1 */
+  size_t namec;
+  struct {
+    uint32_t hash;
+    uint16_t pos;
+    uint16_t slot;
+    char type[2];
+  } rrset[RESPONSE_RRSETS];
+  uint16_t rrslot[RESPONSE_RRSLOTS];
+  size_t rrsetc;
+  int rrsetfull;
+  size_t rdata;
+
+  int edns; /* query carried an OPT record */
+  int dnssec; /* DO bit to echo in our OPT */
+  uint16_t payload; /* UDP payload size advertised by the client */
+  uint8_t xrcode; /* upper bits of an extended RCODE */
+
+  uint64_t truncated; /* responses sent with TC set */
+  uint64_t avoided; /* UDP responses over 512 bytes sent without TC */
+};
+
+int response_addbytes(struct response *rs, const char *buf, unsigned int len);
+int response_addshort(struct response *rs, uint16_t u);
+int response_addlong(struct response *rs, uint32_t u);
+int response_addname(struct response *rs, const char *d);
+
+size_t response_length(struct response *rs);
+int response_copy(struct response *rs, size_t *pos, char *out, size_t len);
+int response_getname(struct response *rs, size_t *pos, stralloc *d);
+int response_skipname(struct response *rs, size_t *pos);
+int response_seen(struct response *rs, const char *d, const char type[2]);
+
+int response_query(struct response *rs, stralloc *r, stralloc *qname,
+  char qtype[2], char qclass[2]);
+void response_authoritative(struct response *rs, int flag);
+void response_rcode(struct response *rs, uint8_t rcode);
+int response_rstart(struct response *rs, const char *d, const char type[2],
+  uint32_t ttl);
+void response_rfinish(struct response *rs, size_t section);
+size_t response_limit(struct response *rs, size_t max);
+int response_fits(struct response *rs, size_t max);
+void response_finish(struct response *rs, size_t max);
 
 #endif
@@ -0,0 +1,133 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rrl.h"
+
+/* Responses are limited per client network, a /24 for IPv4 or a /56 for
+   IPv6, and per class of response, so a flood of spoofed queries for one
+   kind of answer cannot starve the same network of other answers. */
+
+#define CLASS_ANSWER 1
+#define CLASS_EMPTY 2 /* no data, or a referral */
+#define CLASS_NXDOMAIN 3
+#define CLASS_ERROR 4
+
+static const uint8_t mapped[12] = { [10] = 0xff, [11] = 0xff };
+
+/* Threads sharing a table must use the same rate. */
+
+int rrl_init(struct rrl *rrl, const struct rrl *share, uint32_t rate,
+    uint32_t slip) {
+  rrl->sets = RRL_BUCKETS / RRL_WAYS;
+  if (share)
+    rrl->bucket = share->bucket;
+  else
+    rrl->bucket = calloc(RRL_BUCKETS, sizeof *rrl->bucket);
+  rrl->rate = rate;
+  rrl->slip = slip;
+  return rrl->bucket != 0;
+}
+
+void rrl_clock(struct rrl *rrl) {
+  struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  rrl->now = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t key(const uint8_t *ip, size_t iplen, const char *response) {
+  uint64_t k = 0;
+  size_t prefix = 7;
+
+  if (iplen == 16 && !memcmp(ip, mapped, sizeof mapped))
+    ip += 12, iplen = 4;
+  if (iplen == 4)
+    prefix = 3;
+  for (size_t i = 0; i < prefix && i < iplen; i++)
+    k = k << 8 | ip[i];
+
+  switch (response[3] & 15) {
+    case 0:
+      k = k << 3 | (response[6] || response[7] ? CLASS_ANSWER : CLASS_EMPTY);
+      break;
+    case 3:
+      k = k << 3 | CLASS_NXDOMAIN;
+      break;
+    default:
+      k = k << 3 | CLASS_ERROR;
+  }
+  return k << 1 | (prefix == 7) | (uint64_t) 1 << 63;
+}
+
+int rrl_check(struct rrl *rrl, const void *ip, size_t iplen,
+    const char *response, size_t len) {
+  struct rrl_bucket *b, *victim;
+  uint64_t k, found, state, next;
+  uint32_t stamp, full = rrl->rate * 1000;
+  int32_t age, oldest = INT32_MIN;
+  int64_t tokens;
+  int send;
+
+  if (len < 12)
+    return RRL_SEND;
+
+  k = key(ip, iplen, response);
+  victim = b = rrl->bucket + (k * 0x9e3779b97f4a7c15 >> 32) % rrl->sets
+    * RRL_WAYS;
+  for (size_t i = 0; i < RRL_WAYS; i++, b++) {
+    if ((found = __atomic_load_n(&b->key, __ATOMIC_RELAXED)) == k)
+      break;
+    stamp = __atomic_load_n(&b->state, __ATOMIC_RELAXED) >> 32;
+    age = found ? (int32_t) (rrl->now - stamp) : INT32_MAX;
+    if (age > oldest) {
+      oldest = age;
+      victim = b;
+    }
+  }
+
+  /* A new bucket starts full. Two threads may claim buckets for the same
+     network at once, which only lets a few extra responses through. */
+  if (found != k) {
+    b = victim;
+    __atomic_store_n(&b->key, k, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->state, (uint64_t) rrl->now << 32 | full,
+      __ATOMIC_RELAXED);
+  }
+
+  /* An old bucket earns tokens for the time since it was last credited,
+     up to one second's worth. A bucket with nothing to credit or spend is
+     left alone, so a flood does not bounce it between threads. */
+  state = __atomic_load_n(&b->state, __ATOMIC_RELAXED);
+  do {
+    stamp = state >> 32;
+    tokens = (int32_t) state;
+    if ((int32_t) (rrl->now - stamp) > 0) {
+      age = rrl->now - stamp;
+      tokens += (int64_t) (age < 1000 ? age : 1000) * rrl->rate;
+      if (tokens > full)
+        tokens = full;
+      stamp = rrl->now;
+    }
+    if ((send = tokens >= 1000))
+      tokens -= 1000;
+    else if (stamp == state >> 32)
+      break;
+    next = (uint64_t) stamp << 32 | (uint32_t) tokens;
+  } while (!__atomic_compare_exchange_n(&b->state, &state, next, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  if (send)
+    return RRL_SEND;
+  if (rrl->slip && ++rrl->excess % rrl->slip == 0) {
+    rrl->slipped++;
+    return RRL_SLIP;
+  }
+  rrl->dropped++;
+  return RRL_DROP;
+}
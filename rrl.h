@@ -0,0 +1,41 @@
+#ifndef RRL_H
+#define RRL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RRL_BUCKETS 16384 /* token buckets shared by all threads */
+#define RRL_WAYS 4 /* buckets per set, filling one cache line */
+#define RRL_RATE 1000000 /* largest permitted rate */
+
+#define RRL_SEND 0
+#define RRL_DROP 1
+#define RRL_SLIP 2 /* send a truncated response instead */
+
+/* Buckets are updated atomically so that every thread can share one
+   table, with the time of the last credit and the tokens in one word. */
+
+struct rrl_bucket {
+  uint64_t key; /* 0 if unused */
+  uint64_t state; /* milliseconds << 32 | thousandths of a response */
+};
+
+struct rrl {
+  struct rrl_bucket *bucket; /* possibly shared with other threads */
+  size_t sets;
+  uint32_t rate; /* responses per second per bucket */
+  uint32_t slip; /* send every slip-th excess response truncated */
+  uint32_t now;
+  uint64_t excess;
+
+  uint64_t dropped;
+  uint64_t slipped;
+};
+
+int rrl_init(struct rrl *rrl, const struct rrl *share, uint32_t rate,
+  uint32_t slip);
+void rrl_clock(struct rrl *rrl);
+int rrl_check(struct rrl *rrl, const void *ip, size_t iplen,
+  const char *response, size_t len);
+
+#endif
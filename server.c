@@ -1,16 +1,60 @@
 #include <err.h>
 #include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include "scan.h"
+#include "server.h"
 #include "stralloc.h"
 
-void attach(const char *address, const char *port);
-void serve(void);
+volatile sig_atomic_t reporting;
+size_t cachesize = 4096;
+
+static void report(int signal) {
+  reporting = 1;
+}
+
+int bindsocket(const struct addrinfo *info) {
+  int fd, one = 1;
+
+  fd = socket(info->ai_family, info->ai_socktype, 0);
+  if (fd < 0)
+    err(1, "socket");
+  if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+    err(1, "fcntl F_SETFL O_NONBLOCK");
+
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+#if defined SO_REUSEPORT_LB
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT_LB, &one, sizeof one);
+#elif defined SO_REUSEPORT
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one);
+#endif
+
+#if defined IP_FREEBIND && defined IPV6_FREEBIND
+  if (info->ai_family == AF_INET)
+    setsockopt(fd, IPPROTO_IP, IP_FREEBIND, &one, sizeof one);
+  if (info->ai_family == AF_INET6)
+    setsockopt(fd, IPPROTO_IPV6, IPV6_FREEBIND, &one, sizeof one);
+#elif defined IP_BINDANY && defined IPV6_BINDANY
+  if (info->ai_family == AF_INET)
+    setsockopt(fd, IPPROTO_IP, IP_BINDANY, &one, sizeof one);
+  if (info->ai_family == AF_INET6)
+    setsockopt(fd, IPPROTO_IPV6, IPV6_BINDANY, &one, sizeof one);
+#elif defined SO_BINDANY
+  setsockopt(fd, SOL_SOCKET, SO_BINDANY, &one, sizeof one);
+#endif
+
+  if (bind(fd, info->ai_addr, info->ai_addrlen) < 0)
+    err(1, "bind");
+  return fd;
+}
 
 static void droproot(const char *user) {
   uint32_t uid = -1, gid = -1;
@@ -49,20 +93,28 @@ static int usage(const char *progname) {
   fprintf(stderr, "\
 Usage: %s [OPTIONS] ADDRESS...\n\
 Options:\n\
+  -c ENTRIES    cache up to ENTRIES responses in each thread (default 4096)\n\
   -d DIR        change directory to DIR before opening data.cdb\n\
   -f            run in the foreground instead of daemonizing\n\
   -u UID:GID    run with the specified numeric uid and gid\n\
   -u USERNAME   run with the uid and gid of user USERNAME\n\
-", progname);
+%s", progname, optionhelp);
   return 64;
 }
 
 int main(int argc, char **argv) {
   int fd, foreground = 0, option;
-  char *user = 0;
+  char *user = 0, optstring[64];
+  uint32_t u;
 
-  while ((option = getopt(argc, argv, ":d:fu:")) > 0)
+  snprintf(optstring, sizeof optstring, ":c:d:fu:%s", options);
+  while ((option = getopt(argc, argv, optstring)) > 0)
     switch (option) {
+      case 'c':
+        if (scan_uint32(optarg, &u) != strlen(optarg))
+          errx(1, "Invalid cache size: %s", optarg);
+        cachesize = u;
+        break;
       case 'd':
         if (chdir(optarg) < 0)
           err(1, "chdir");
@@ -74,7 +126,8 @@ int main(int argc, char **argv) {
         user = optarg;
         break;
       default:
-        return usage(argv[0]);
+        if (option == '?' || option == ':' || !configure(option, optarg))
+          return usage(argv[0]);
     }
 
   if (argc <= optind)
@@ -107,6 +160,7 @@ int main(int argc, char **argv) {
     }
   }
 
+  sigaction(SIGUSR1, &(struct sigaction) { .sa_handler = report }, 0);
   serve();
   return 0;
 }
@@ -0,0 +1,18 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <signal.h>
+#include <stddef.h>
+
+struct addrinfo;
+
+extern const char options[], optionhelp[];
+extern volatile sig_atomic_t reporting;
+extern size_t cachesize;
+
+int bindsocket(const struct addrinfo *info);
+int configure(int option, const char *arg);
+void attach(const char *address, const char *port);
+void serve(void);
+
+#endif
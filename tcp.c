@@ -0,0 +1,840 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "lookup.h"
+#include "pack.h"
+#include "scan.h"
+#include "server.h"
+#include "stralloc.h"
+#include "tcp.h"
+#include "uring.h"
+
+static const struct tcp_pool pool[] = {
+  { .size = 512, .limit = 4096 },
+  { .size = 4096, .limit = 1024 },
+  { .size = 65535 + 2, .limit = 64 }
+};
+
+/* Linux accepts TCP_FASTOPEN on a listener even when Fast Open is
+   disabled for servers, in which case the option has no effect. */
+
+static int fastopen_enabled(void) {
+#ifdef __linux__
+  char buffer[16] = { 0 };
+  uint32_t mode;
+  int fd = open("/proc/sys/net/ipv4/tcp_fastopen", O_RDONLY);
+  ssize_t len = fd < 0 ? -1 : read(fd, buffer, sizeof buffer - 1);
+
+  if (fd >= 0)
+    close(fd);
+  if (len > 0 && scan_uint32(buffer, &mode) > 0)
+    return (mode & 2) != 0;
+#endif
+  return 1;
+}
+
+int tcp_socket(const struct addrinfo *info, uint32_t defer,
+    uint32_t fastopen) {
+  int fd = bindsocket(info);
+
+  if (listen(fd, SOMAXCONN) < 0)
+    err(1, "listen");
+
+  if (defer) {
+#ifdef TCP_DEFER_ACCEPT
+    if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+          &defer, sizeof defer) < 0)
+      err(1, "setsockopt TCP_DEFER_ACCEPT");
+#else
+    errx(1, "Deferred accept is not supported on this platform");
+#endif
+  }
+
+  if (fastopen) {
+#ifdef TCP_FASTOPEN
+    if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN,
+          &fastopen, sizeof fastopen) < 0)
+      err(1, "setsockopt TCP_FASTOPEN");
+    if (!fastopen_enabled())
+      errx(1, "TCP Fast Open is disabled for servers by "
+        "net.ipv4.tcp_fastopen");
+#else
+    errx(1, "TCP Fast Open is not supported on this platform");
+#endif
+  }
+  return fd;
+}
+
+void tcp_listen(struct tcp *t, int fd) {
+  if (t->listeners >= sizeof t->listener / sizeof *t->listener)
+    errx(1, "Too many listening addresses");
+  t->listener[t->listeners].owner = t;
+  t->listener[t->listeners++].fd = fd;
+}
+
+/* No more is read from a stream while its queue is full or its backlog
+   is waiting for the client. */
+static int backed_up(struct stream *s) {
+  return s->replies >= sizeof s->queue / sizeof *s->queue
+    || s->backlog >= TCP_BACKLOG;
+}
+
+#ifdef EPOLLET
+
+/* Streams are registered once for edge-triggered readiness, and each
+   edge is followed until the stream has to wait again. */
+
+static int watch(struct tcp *t, int fd, void *ptr, uint32_t events) {
+  struct epoll_event event = { .events = events, .data.ptr = ptr };
+
+  return epoll_ctl(t->epfd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+/* Closing a stream removes it from the set, and its registration never
+   needs to change. */
+
+static void unwatch(struct stream *s) {
+}
+
+static void rearm(struct stream *s) {
+}
+
+size_t tcp_wait(struct tcp *t, void *ready[TCP_EVENTS]) {
+  struct epoll_event event[TCP_EVENTS];
+  int count = epoll_wait(t->epfd, event, TCP_EVENTS, -1);
+
+  if (count < 0) {
+    if (errno == EINTR)
+      return 0;
+    err(1, "epoll_wait");
+  }
+  for (int i = 0; i < count; i++)
+    ready[i] = event[i].data.ptr;
+  return count;
+}
+
+#else
+
+/* Without edge-triggered events, each stream polls only for whatever
+   would let it make progress, and streams are removed by moving the
+   last one into their slot. */
+
+static int watch(struct tcp *t, int fd, void *ptr, short events) {
+  if (t->polls >= t->size) {
+    size_t size = t->size ? 2 * t->size : 64;
+    struct pollfd *pollfd = realloc(t->pollfd, size * sizeof *pollfd);
+    void **polled = pollfd ? realloc(t->polled, size * sizeof *polled) : 0;
+
+    if (pollfd)
+      t->pollfd = pollfd;
+    if (!polled)
+      return 0;
+    t->polled = polled;
+    t->size = size;
+  }
+
+  t->pollfd[t->polls] = (struct pollfd) { .fd = fd, .events = events };
+  t->polled[t->polls++] = ptr;
+  return 1;
+}
+
+static void unwatch(struct stream *s) {
+  struct tcp *t = s->owner;
+  struct stream *last = t->polled[--t->polls];
+
+  t->pollfd[s->slot] = t->pollfd[t->polls];
+  t->polled[s->slot] = last;
+  last->slot = s->slot;
+}
+
+static void rearm(struct stream *s) {
+  short events = s->replies > 0 ? POLLOUT : 0;
+
+  if (!backed_up(s) && !s->eof)
+    events |= POLLIN;
+  s->owner->pollfd[s->slot].events = events;
+}
+
+/* Report ready descriptors starting after the last one reported, so
+   none is starved when more are ready than fit in one batch. */
+
+size_t tcp_wait(struct tcp *t, void *ready[TCP_EVENTS]) {
+  size_t count = 0, start = t->cursor;
+
+  if (poll(t->pollfd, t->polls, -1) < 0) {
+    if (errno == EINTR)
+      return 0;
+    err(1, "poll");
+  }
+
+  for (size_t n = 0; n < t->polls && count < TCP_EVENTS; n++) {
+    size_t i = (start + n) % t->polls;
+    if (t->pollfd[i].revents) {
+      ready[count++] = t->polled[i];
+      t->cursor = i + 1;
+    }
+  }
+  return count;
+}
+
+#endif
+
+void tcp_init(struct tcp *t, struct lookup_ctx *lookup, size_t limit) {
+  t->lookup = lookup;
+  t->limit = limit;
+  memcpy(t->pool, pool, sizeof t->pool);
+
+#ifdef EPOLLET
+  if ((t->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    err(1, "epoll_create1");
+#endif
+  for (size_t i = 0; i < t->listeners; i++)
+    tcp_watch(t, t->listener[i].fd, t->listener + i);
+}
+
+/* Other descriptors can share the event loop, as long as they are added
+   before any stream is accepted. */
+
+void tcp_watch(struct tcp *t, int fd, void *ptr) {
+#ifdef EPOLLET
+  if (!watch(t, fd, ptr, EPOLLIN))
+    err(1, "epoll_ctl");
+#else
+  if (!watch(t, fd, ptr, POLLIN))
+    err(1, "malloc");
+#endif
+}
+
+/* Buffers are recycled through a free list for each size class, with
+   only a limited number kept idle so memory follows active traffic. */
+
+static char *borrow(struct tcp *t, size_t len, size_t *size) {
+  struct tcp_pool *p = t->pool;
+
+  for (; p < t->pool + sizeof t->pool / sizeof *t->pool; p++)
+    if (len <= p->size) {
+      char *buffer = p->free;
+      if (buffer) {
+        memcpy(&p->free, buffer, sizeof p->free);
+        p->count--;
+      } else if (!(buffer = malloc(p->size))) {
+        return 0;
+      }
+      *size = p->size;
+      return buffer;
+    }
+  return 0;
+}
+
+static void giveback(struct tcp *t, char *buffer, size_t size) {
+  struct tcp_pool *p = t->pool;
+
+  for (; p < t->pool + sizeof t->pool / sizeof *t->pool; p++)
+    if (size == p->size) {
+      if (p->count >= p->limit)
+        break;
+      memcpy(buffer, &p->free, sizeof p->free);
+      p->free = buffer;
+      p->count++;
+      return;
+    }
+  free(buffer);
+}
+
+static void release(struct stream *s) {
+  if (s->input)
+    giveback(s->owner, s->input, s->size);
+  s->input = 0;
+  s->size = s->start = s->end = 0;
+}
+
+/* Return the length of the query at the front of the input buffer
+   including its length prefix, or 0 if it is not yet complete. */
+static size_t complete(struct stream *s) {
+  size_t len;
+
+  if (s->end - s->start < 2)
+    return 0;
+  len = unpack_uint16_big(s->input + s->start) + 2;
+  return s->end - s->start < len ? 0 : len;
+}
+
+static int respond(struct stream *s, size_t len) {
+  struct reply *reply = s->queue + s->replies;
+  struct tcp *t = s->owner;
+  stralloc r = {
+    .s = t->scratch + 2,
+    .len = len - 2,
+    .size = sizeof t->scratch - 2,
+    .limit = -1
+  };
+
+  /* Answer in the shared scratch buffer, then queue the response in a
+     pooled buffer of the right size behind any earlier answers. */
+  memcpy(r.s, s->input + s->start + 2, r.len);
+  s->start += len;
+
+  if (s->peer.ss_family == AF_INET)
+    lookup_ctx_query(t->lookup, &r, -1,
+      &((struct sockaddr_in *) &s->peer)->sin_addr, 4);
+  else if (s->peer.ss_family == AF_INET6)
+    lookup_ctx_query(t->lookup, &r, -1,
+      &((struct sockaddr_in6 *) &s->peer)->sin6_addr, 16);
+  else
+    return 0;
+
+  if (r.len == 0 || !(reply->buffer = borrow(t, r.len + 2, &reply->size)))
+    return 0;
+  pack_uint16_big(reply->buffer, r.len);
+  memcpy(reply->buffer + 2, r.s, r.len);
+  reply->len = r.len + 2;
+  s->backlog += reply->len;
+  s->replies++;
+  return 1;
+}
+
+static int receive(struct stream *s) {
+  size_t len = 2, size;
+  ssize_t count;
+  char *input;
+
+  if (s->start > 0) {
+    memmove(s->input, s->input + s->start, s->end - s->start);
+    s->end -= s->start;
+    s->start = 0;
+  }
+
+  /* Grow the buffer once the length of a partial query is known. */
+  if (s->end >= 2 && (len = unpack_uint16_big(s->input) + 2) == 2)
+    return -1;
+  if (len > s->size) {
+    if (!(input = borrow(s->owner, len > 512 ? len : 512, &size)))
+      return -1;
+    if (s->input) {
+      memcpy(input, s->input, s->end);
+      giveback(s->owner, s->input, s->size);
+    }
+    s->input = input;
+    s->size = size;
+  }
+
+  count = read(s->fd, s->input + s->end, s->size - s->end);
+  if (count < 0)
+    if (errno == EINTR || errno == EAGAIN) {
+      s->drained = errno == EAGAIN;
+      return 1;
+    }
+  if (count < 0)
+    return -1;
+  if (count == 0)
+    s->eof = 1;
+  s->end += count;
+  return 1;
+}
+
+/* Point iov at the unwritten part of every queued reply. */
+static void gather(struct stream *s, struct iovec *iov) {
+  for (size_t i = 0; i < s->replies; i++) {
+    iov[i].iov_base = s->queue[i].buffer;
+    iov[i].iov_len = s->queue[i].len;
+  }
+  iov->iov_base = (char *) iov->iov_base + s->sent;
+  iov->iov_len -= s->sent;
+}
+
+/* Recycle every reply which has now been written in full. */
+static void written(struct stream *s, size_t count) {
+  s->backlog -= count;
+  count += s->sent;
+  for (size_t i = 0; i < s->replies; i++) {
+    if (count < s->queue[i].len) {
+      memmove(s->queue, s->queue + i, (s->replies - i) * sizeof *s->queue);
+      s->replies -= i;
+      s->sent = count;
+      return;
+    }
+    count -= s->queue[i].len;
+    giveback(s->owner, s->queue[i].buffer, s->queue[i].size);
+  }
+  s->replies = 0;
+  s->sent = 0;
+}
+
+static int flush(struct stream *s) {
+  struct iovec iov[sizeof s->queue / sizeof *s->queue];
+  ssize_t count;
+
+  gather(s, iov);
+  count = writev(s->fd, iov, s->replies);
+  if (count < 0)
+    if (errno == EINTR || errno == EAGAIN)
+      return errno == EINTR;
+  if (count <= 0)
+    return -1;
+  written(s, count);
+  return 1;
+}
+
+static void unlink_stream(struct stream *s) {
+  struct tcp *t = s->owner;
+
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    t->oldest = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+  else
+    t->newest = s->prev;
+  s->prev = s->next = 0;
+}
+
+static void touch(struct stream *s) {
+  struct tcp *t = s->owner;
+
+  if (s != t->newest) {
+    if (s->prev || s->next || s == t->oldest)
+      unlink_stream(s);
+    s->prev = t->newest;
+    if (t->newest)
+      t->newest->next = s;
+    else
+      t->oldest = s;
+    t->newest = s;
+  }
+}
+
+static void drop(struct stream *s) {
+  if (!s->closing) {
+    unwatch(s);
+    unlink_stream(s);
+    s->owner->streams--;
+    s->closing = 1;
+  }
+
+  /* Requests in flight on io_uring still refer to the stream, so shut it
+     down to end them and free it once the last one completes. */
+  if (s->pending > 0) {
+    shutdown(s->fd, SHUT_RDWR);
+    return;
+  }
+  close(s->fd);
+  release(s);
+  for (size_t i = 0; i < s->replies; i++)
+    giveback(s->owner, s->queue[i].buffer, s->queue[i].size);
+  free(s);
+}
+
+/* Accept every connection waiting on the listener. */
+static void new(struct stream *l) {
+  struct tcp *t = l->owner;
+  struct sockaddr_storage sa;
+  socklen_t salen = sizeof sa;
+  struct stream *s;
+  int client;
+
+#ifdef SOCK_NONBLOCK
+  while ((client = accept4(l->fd, (void *) &sa, &salen, SOCK_NONBLOCK)) >= 0
+#else
+  while ((client = accept(l->fd, (void *) &sa, &salen)) >= 0
+#endif
+      || errno == EINTR || errno == ECONNABORTED) {
+#ifndef SOCK_NONBLOCK
+    if (client >= 0 && fcntl(client, F_SETFL, O_NONBLOCK) < 0) {
+      close(client);
+      client = -1;
+    }
+#endif
+    if (client < 0 || !(s = calloc(1, sizeof *s))) {
+      if (client >= 0)
+        close(client);
+      salen = sizeof sa;
+      continue;
+    }
+
+    /* Make room by closing the stream that has been idle the longest. */
+    if (t->streams >= t->limit)
+      drop(t->oldest);
+
+    s->owner = t;
+    s->fd = client;
+    s->peer = sa;
+#ifdef EPOLLET
+    if (!watch(t, client, s, EPOLLIN | EPOLLOUT | EPOLLET)) {
+#else
+    s->slot = t->polls;
+    if (!watch(t, client, s, POLLIN)) {
+#endif
+      close(client);
+      free(s);
+    } else {
+      touch(s);
+      t->streams++;
+    }
+    salen = sizeof sa;
+  }
+}
+
+/* Advance the stream by one step, returning 1 if it made progress,
+   0 if it must wait for another edge and -1 if it should be dropped.
+   Every buffered query is answered before the queue is flushed, so
+   pipelined queries share a single write. */
+static int stream(struct stream *s) {
+  int full = backed_up(s);
+  size_t len;
+  int rc;
+
+  if (!full && (len = complete(s)))
+    return respond(s, len) ? 1 : -1;
+  if (!full && !s->drained && !s->eof)
+    return receive(s);
+
+  if (s->replies > 0) {
+    if ((rc = flush(s)) <= 0)
+      return rc;
+    if (s->replies == 0)
+      touch(s);
+    return 1;
+  }
+
+  if (s->eof)
+    return -1;
+  if (s->start == s->end)
+    release(s);
+  return 0;
+}
+
+void tcp_events(struct tcp *t, void **ready, size_t count) {
+  int rc;
+
+  /* Service streams before accepting, as accepting may evict a stream
+     which still has an event pending in this batch. */
+  for (size_t i = 0; i < count; i++) {
+    struct stream *s = ready[i];
+    if (s >= t->listener && s < t->listener + t->listeners)
+      continue;
+    s->drained = 0;
+    while ((rc = stream(s)) > 0)
+      continue;
+    if (rc < 0)
+      drop(s);
+    else
+      rearm(s);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    struct stream *s = ready[i];
+    if (s >= t->listener && s < t->listener + t->listeners)
+      new(s);
+  }
+}
+
+#ifdef URING
+#define RING_ENTRIES 1024 /* submission queue entries */
+#define RING_BUFFERS 256 /* provided receive buffers, a power of two */
+#define RING_SIZE 2048 /* bytes in each receive buffer */
+
+/* Each request carries its stream and one of these tags in user_data,
+   relying on streams being at least four-byte aligned. */
+enum { ACCEPT, RECEIVE, WRITE, CANCEL };
+
+/* Listeners accept and streams receive with multishot requests, the
+   kernel choosing a provided buffer for each arrival, which is copied
+   into the stream input before being returned to the ring. Each stream
+   has at most one write in flight, for every reply queued when it was
+   submitted, and the next is queued when it completes. */
+
+struct tcp_ring {
+  struct uring r;
+  struct io_uring_buf_ring *buffers;
+  char *pool;
+  uint16_t tail;
+  int error; /* set once a listener fails for good */
+};
+
+static void provide(struct tcp_ring *g, uint16_t id) {
+  struct io_uring_buf *b = g->buffers->bufs + (g->tail & (RING_BUFFERS - 1));
+
+  b->addr = (uintptr_t) (g->pool + id * RING_SIZE);
+  b->len = RING_SIZE;
+  b->bid = id;
+  __atomic_store_n(&g->buffers->tail, ++g->tail, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *request(struct stream *s, uint8_t opcode,
+    int tag) {
+  struct io_uring_sqe *sqe = uring_sqe(&s->owner->ring->r);
+
+  if (sqe) {
+    sqe->opcode = opcode;
+    sqe->fd = s->fd;
+    sqe->user_data = (uintptr_t) s | tag;
+    s->pending++;
+  }
+  return sqe;
+}
+
+static void listen_ring(struct stream *l) {
+  struct io_uring_sqe *sqe = request(l, IORING_OP_ACCEPT, ACCEPT);
+
+  /* Streams are left blocking, as io_uring would fail a write to a
+     nonblocking socket with EAGAIN rather than wait for room. */
+  if (sqe)
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  else
+    l->owner->ring->error = errno;
+}
+
+static int arm(struct stream *s) {
+  struct io_uring_sqe *sqe = request(s, IORING_OP_RECV, RECEIVE);
+
+  if (!sqe)
+    return 0;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  s->reading = 1;
+  return 1;
+}
+
+/* The peer address of a multishot accept would be overwritten by the
+   next connection, so it is looked up for each stream instead. */
+static void admit(struct stream *l, int fd) {
+  struct tcp *t = l->owner;
+  struct stream *s = calloc(1, sizeof *s);
+  socklen_t salen = sizeof s->peer;
+
+  if (!s || getpeername(fd, (void *) &s->peer, &salen) < 0) {
+    close(fd);
+    free(s);
+    return;
+  }
+
+  /* Make room by closing the stream that has been idle the longest. */
+  if (t->streams >= t->limit)
+    drop(t->oldest);
+
+  s->owner = t;
+  s->fd = fd;
+  if (!arm(s)) {
+    close(fd);
+    free(s);
+  } else {
+    touch(s);
+    t->streams++;
+  }
+}
+
+/* Append received bytes to the input of a stream, keeping any partial
+   query at the front of a buffer large enough for both. */
+static int append(struct stream *s, const char *data, size_t len) {
+  size_t size;
+  char *input;
+
+  if (s->start > 0) {
+    memmove(s->input, s->input + s->start, s->end - s->start);
+    s->end -= s->start;
+    s->start = 0;
+  }
+  if (s->end + len > s->size) {
+    if (!(input = borrow(s->owner, s->end + len > 512 ? s->end + len : 512,
+          &size)))
+      return 0;
+    if (s->input) {
+      memcpy(input, s->input, s->end);
+      giveback(s->owner, s->input, s->size);
+    }
+    s->input = input;
+    s->size = size;
+  }
+  memcpy(s->input + s->end, data, len);
+  s->end += len;
+  return 1;
+}
+
+/* Answer the complete queries buffered on a stream, write any replies
+   unless a write is already in flight and receive only while they are
+   not backed up. Returns 0 once the stream is finished with. */
+static int proceed(struct stream *s) {
+  struct io_uring_sqe *sqe;
+  size_t len;
+
+  while (!backed_up(s) && (len = complete(s)))
+    if (!respond(s, len))
+      return 0;
+  if (s->start == s->end)
+    release(s);
+
+  if (s->replies > 0 && !s->writing) {
+    if (!(sqe = request(s, IORING_OP_WRITEV, WRITE)))
+      return 0;
+    gather(s, s->written);
+    sqe->addr = (uintptr_t) s->written;
+    sqe->len = s->replies;
+    s->writing = 1;
+  }
+
+  /* A cancelled receive sets reading to 0 when its last completion
+     arrives, and is armed again once the replies have gone. */
+  if (backed_up(s) && s->reading == 1) {
+    if (!(sqe = request(s, IORING_OP_ASYNC_CANCEL, CANCEL)))
+      return 0;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t) s | RECEIVE;
+    s->reading = 2;
+  }
+  if (!backed_up(s) && !s->reading && !s->eof && !arm(s))
+    return 0;
+  return !s->eof || s->writing;
+}
+
+static void completion(struct tcp *t, struct io_uring_cqe *cqe) {
+  struct tcp_ring *g = t->ring;
+  struct stream *s = (void *) (uintptr_t) (cqe->user_data & ~(uint64_t) 3);
+  int more = cqe->flags & IORING_CQE_F_MORE, ok = 1;
+
+  switch (cqe->user_data & 3) {
+    case ACCEPT:
+      if (cqe->res >= 0)
+        admit(s, cqe->res);
+      if (!more) {
+        s->pending--;
+        if (cqe->res == -EINVAL)
+          g->error = EINVAL;
+        else
+          listen_ring(s);
+      }
+      return;
+
+    case RECEIVE:
+      if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !s->closing)
+          ok = append(s, g->pool + id * RING_SIZE, cqe->res);
+        provide(g, id);
+      }
+      if (cqe->res == 0)
+        s->eof = 1;
+
+      /* The receive stops if the buffers run out or it is cancelled, so
+         it can be armed again, but any other error ends the stream. */
+      if (!more) {
+        s->pending--;
+        s->reading = 0;
+        if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)
+          ok = 0;
+      }
+      break;
+
+    case WRITE:
+      s->pending--;
+      s->writing = 0;
+      if (cqe->res <= 0)
+        ok = 0;
+      else if (!s->closing) {
+        written(s, cqe->res);
+        if (s->replies == 0)
+          touch(s);
+      }
+      break;
+
+    case CANCEL:
+      s->pending--;
+      break;
+  }
+
+  if (s->closing || !ok || !proceed(s))
+    drop(s);
+}
+
+static void unring(struct tcp_ring *g) {
+  if (g->buffers)
+    uring_buffers_free(&g->r, 0, g->buffers, RING_BUFFERS);
+  uring_free(&g->r);
+  free(g->pool);
+  free(g);
+}
+
+int tcp_ring(struct tcp *t) {
+  struct tcp_ring *g;
+  struct io_uring_cqe *cqe;
+
+  if (!(g = calloc(1, sizeof *g)))
+    return 0;
+  if (!uring_init(&g->r, RING_ENTRIES)) {
+    free(g);
+    return 0;
+  }
+  if (!(g->buffers = uring_buffers(&g->r, 0, RING_BUFFERS)))
+    goto fail;
+  if (!(g->pool = malloc(RING_BUFFERS * RING_SIZE)))
+    err(1, "malloc");
+  for (uint16_t id = 0; id < RING_BUFFERS; id++)
+    provide(g, id);
+
+  t->ring = g;
+  for (size_t i = 0; i < t->listeners; i++)
+    listen_ring(t->listener + i);
+
+  /* Kernels without multishot accepts reject them as they are submitted,
+     so find out now and let the caller fall back to tcp_wait(). */
+  if (uring_enter(&g->r, 0) < 0)
+    goto fail;
+  while ((cqe = uring_cqe(&g->r))) {
+    completion(t, cqe);
+    uring_seen(&g->r);
+  }
+  if (g->error)
+    goto fail;
+  return 1;
+
+fail:
+  t->ring = 0;
+  unring(g);
+  return 0;
+}
+
+int tcp_ring_wait(struct tcp *t) {
+  struct tcp_ring *g = t->ring;
+  struct io_uring_cqe *cqe;
+
+  if (uring_enter(&g->r, 1) < 0)
+    return -1;
+  while ((cqe = uring_cqe(&g->r))) {
+    completion(t, cqe);
+    uring_seen(&g->r);
+  }
+  if (g->error) {
+    errno = g->error;
+    return -1;
+  }
+  return 0;
+}
+
+#else
+
+int tcp_ring(struct tcp *t) {
+  return 0;
+}
+
+int tcp_ring_wait(struct tcp *t) {
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef TCP_H
+#define TCP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define TCP_EVENTS 64 /* descriptors reported by each tcp_wait() */
+#define TCP_QUEUE 32 /* replies queued on a stream before reading stops */
+#define TCP_BACKLOG 65536 /* unwritten bytes before reading stops */
+
+struct addrinfo;
+struct lookup_ctx;
+struct pollfd;
+struct tcp_ring;
+
+struct reply {
+  char *buffer;
+  size_t size;
+  size_t len;
+};
+
+struct stream {
+  struct stream *prev, *next; /* least recently active first */
+  struct tcp *owner;
+  int fd;
+  struct sockaddr_storage peer;
+  char *input; /* borrowed from a pool only while a query is buffered */
+  size_t size;
+  size_t start;
+  size_t end;
+  struct reply queue[TCP_QUEUE]; /* answers waiting to be written */
+  size_t replies;
+  size_t sent; /* bytes of the first reply already written */
+  size_t backlog; /* unwritten bytes across the queue */
+  int drained, eof;
+  struct iovec written[TCP_QUEUE]; /* replies being written by io_uring */
+  int reading, writing, closing;
+  int pending; /* io_uring requests in flight */
+#ifndef EPOLLET
+  size_t slot; /* index in the poll set */
+#endif
+};
+
+struct tcp_pool {
+  size_t size;
+  size_t count;
+  size_t limit;
+  void *free;
+};
+
+struct tcp {
+  struct stream listener[16], *oldest, *newest;
+  size_t listeners, streams, limit;
+#ifdef EPOLLET
+  int epfd;
+#else
+  /* Listeners and other watched descriptors come first, then streams. */
+  struct pollfd *pollfd;
+  void **polled;
+  size_t polls, size, cursor;
+#endif
+
+  struct tcp_pool pool[3];
+  char scratch[65535 + 2];
+  struct tcp_ring *ring; /* set while io_uring is in use */
+  struct lookup_ctx *lookup;
+};
+
+int tcp_socket(const struct addrinfo *info, uint32_t defer,
+  uint32_t fastopen);
+void tcp_listen(struct tcp *t, int fd);
+void tcp_init(struct tcp *t, struct lookup_ctx *lookup, size_t limit);
+
+/* tcp_wait() blocks until listeners, streams or descriptors added with
+   tcp_watch() are ready, returning their pointers. tcp_events() must then
+   be passed those which do not belong to the caller. */
+
+void tcp_watch(struct tcp *t, int fd, void *ptr);
+size_t tcp_wait(struct tcp *t, void *ready[TCP_EVENTS]);
+void tcp_events(struct tcp *t, void **ready, size_t count);
+
+/* Where io_uring supports multishot accepts and receives, tcp_ring() arms
+   them on the listeners and returns 1; tcp_ring_wait() then serves streams
+   until it is interrupted or the ring fails. Otherwise it returns 0 and
+   tcp_wait() must be used instead. Descriptors added with tcp_watch() are
+   not served by the ring. */
+
+int tcp_ring(struct tcp *t);
+int tcp_ring_wait(struct tcp *t);
+
+#endif
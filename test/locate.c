@@ -0,0 +1,51 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bench/bench.h"
+#include "dns.h"
+#include "lookup.h"
+#include "stralloc.h"
+
+/* Check that clients are answered with the records for their location,
+   including IPv4 clients seen as v4-mapped addresses on an IPv6 socket. */
+
+static struct lookup_ctx ctx;
+static stralloc response;
+static int failed;
+
+static void check(int line, const char *ip, size_t len, const char *a) {
+  bench_query(&response, "www.example.com", DNS_T_A);
+  lookup_ctx_query(&ctx, &response, -1, ip, len);
+
+  if (a ? response.s[7] != 1 || memcmp(response.s + response.len - 4, a, 4)
+        : response.s[7] != 0) {
+    printf("line %d: got %u answers ending %u.%u.%u.%u\n", line,
+      (uint8_t) response.s[7], (uint8_t) response.s[response.len - 4],
+      (uint8_t) response.s[response.len - 3],
+      (uint8_t) response.s[response.len - 2],
+      (uint8_t) response.s[response.len - 1]);
+    failed = 1;
+  }
+}
+
+#define expect(ip, a) check(__LINE__, ip, sizeof ip - 1, a)
+
+int main(void) {
+  FILE *data = bench_data();
+
+  /* 10.0.0.0/24 is location in, and all of IPv6 is location ex. */
+  fprintf(data, ".example.com:ns.example.com\n");
+  fprintf(data, "%%in:4:10.0.0\n");
+  fprintf(data, "%%ex:6:\n");
+  fprintf(data, "+www.example.com:192.0.2.1:::in\n");
+  fprintf(data, "+www.example.com:192.0.2.2:::ex\n");
+  bench_load(data, &ctx);
+
+  expect("\12\0\0\1", "\300\0\2\1");
+  expect("\0\0\0\0\0\0\0\0\0\0\377\377\12\0\0\1", "\300\0\2\1");
+  expect("\12\11\11\11", 0);
+  expect("\0\0\0\0\0\0\0\0\0\0\377\377\12\11\11\11", 0);
+  expect("\40\1\15\270\0\0\0\0\0\0\0\0\0\0\0\1", "\300\0\2\2");
+  return failed;
+}
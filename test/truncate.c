@@ -0,0 +1,158 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench/bench.h"
+#include "dns.h"
+#include "lookup.h"
+#include "pack.h"
+#include "stralloc.h"
+
+/* Check which RRsets response_finish() keeps when a response overflows,
+   both as it is built and as it is replayed from the cache, and which
+   responses are shed while overloaded. */
+
+#define TCP -1 /* no limit, as for tcpdns */
+#define UDP 1232 /* the udpdns cap on EDNS payloads */
+
+static struct lookup_ctx ctx;
+static stralloc response;
+static int failed, shedding;
+
+static void query(const char *name, const char type[2], int payload,
+    size_t max) {
+  char ip[4] = { 127, 0, 0, 1 };
+
+  bench_query(&response, name, type);
+  if (payload) {
+    char opt[11] = { 0, 0, 41 };
+
+    pack_uint16_big(opt + 3, payload);
+    if (!stralloc_catb(&response, opt, sizeof opt))
+      exit(1);
+    response.s[11] = 1;
+  }
+  if (shedding) {
+    struct lookup_query q = { response, max, ip, 4, 1 };
+
+    lookup_ctx_batch(&ctx, &q, 1);
+    response = q.packet;
+  } else {
+    lookup_ctx_query(&ctx, &response, max, ip, 4);
+  }
+}
+
+static void check(int line, unsigned an, unsigned ns, unsigned ar, int tc,
+    size_t max) {
+  unsigned count[3];
+
+  for (int i = 0; i < 3; i++)
+    count[i] = unpack_uint16_big(response.s + 6 + 2 * i);
+  if (count[0] != an || count[1] != ns || count[2] != ar
+      || !(response.s[2] & 2) != !tc || response.len > max) {
+    printf("line %d: got an=%u ns=%u ar=%u tc=%d in %zu bytes,"
+      " expected an=%u ns=%u ar=%u tc=%d within %zu\n", line, count[0],
+      count[1], count[2], !!(response.s[2] & 2), response.len, an, ns, ar,
+      tc, max);
+    failed = 1;
+  }
+}
+
+#define expect(an, ns, ar, tc, max) check(__LINE__, an, ns, ar, tc, max)
+
+int main(void) {
+  FILE *data = bench_data();
+
+  /* mx20 has 20 targets and mx50 has 50, each with an address. The
+     alias www.wide.test points into sub.wide.test, which is delegated to
+     40 name servers with glue, so its answer carries a referral. */
+  fprintf(data, ".example.com:ns.example.com\n");
+  for (int i = 0; i < 50; i++) {
+    if (i < 20)
+      fprintf(data, "@mx20.example.com:m%d.example.com:%d\n", i, i);
+    fprintf(data, "@mx50.example.com:m%d.example.com:%d\n", i, i);
+    fprintf(data, "+m%d.example.com:10.0.0.%d\n", i, i);
+  }
+  fprintf(data, ".wide.test:ns.wide.test\n");
+  fprintf(data, "Cwww.wide.test:host.sub.wide.test\n");
+  for (int i = 0; i < 40; i++) {
+    fprintf(data, "&sub.wide.test:name-server-%d.sub.wide.test\n", i);
+    fprintf(data, "+name-server-%d.sub.wide.test:10.1.0.%d\n", i, i);
+  }
+  bench_load(data, &ctx);
+
+  for (int cached = 0; cached < 2; cached++) {
+    /* Without the cache, each query builds its response again. With
+       it, the first answer goes out over TCP and is stored untrimmed,
+       so the others are cut from the stored copy. */
+    if (!lookup_ctx_cache(&ctx, cached ? 64 : 0))
+      return 1;
+    if (cached) {
+      query("mx20.example.com", DNS_T_MX, 0, TCP);
+      query("mx50.example.com", DNS_T_MX, 0, TCP);
+      query("www.wide.test", DNS_T_A, 0, TCP);
+    }
+
+    /* The answers take 424 bytes with the question, leaving room for
+       five 16-byte addresses. Additional records are optional, so no TC
+       is needed. */
+    query("mx20.example.com", DNS_T_MX, 0, UDP);
+    expect(20, 0, 5, 0, 512);
+
+    /* The referral does not fit after the alias, so it goes with the
+       glue, and TC is set because the authority section is incomplete. */
+    query("www.wide.test", DNS_T_A, 0, UDP);
+    expect(1, 0, 0, 1, 512);
+
+    /* The answer itself does not fit, so only the question is left. */
+    query("mx50.example.com", DNS_T_MX, 0, UDP);
+    expect(0, 0, 0, 1, 512);
+
+    /* EDNS raises the limit to the payload size the client advertises,
+       capped by the server. The OPT record is counted as additional and
+       always kept, so 12 addresses fit with it after 1024 bytes. */
+    query("mx50.example.com", DNS_T_MX, 4096, UDP);
+    expect(50, 0, 13, 0, UDP);
+    query("mx50.example.com", DNS_T_MX, 4096, 4096);
+    expect(50, 0, 51, 0, 4096);
+    query("mx20.example.com", DNS_T_MX, 1232, UDP);
+    expect(20, 0, 21, 0, UDP);
+
+    /* Advertised payloads below 512 bytes are treated as 512. */
+    query("mx20.example.com", DNS_T_MX, 256, UDP);
+    expect(20, 0, 5, 0, 512);
+    query("mx50.example.com", DNS_T_MX, 256, UDP);
+    expect(0, 0, 1, 1, 512);
+
+    /* Streams are never truncated. */
+    query("mx50.example.com", DNS_T_MX, 0, TCP);
+    expect(50, 0, 50, 0, TCP);
+    query("www.wide.test", DNS_T_A, 0, TCP);
+    expect(1, 40, 40, 0, TCP);
+  }
+
+  /* While shedding, answers which only lose additional or authority
+     records are still sent, and only those which would be cut to the
+     question anyway are counted as shed. Cached responses are never
+     shed, so the cache is turned off. */
+  if (!lookup_ctx_cache(&ctx, 0))
+    return 1;
+  shedding = 1;
+  query("mx20.example.com", DNS_T_MX, 0, UDP);
+  expect(20, 0, 5, 0, 512);
+  query("www.wide.test", DNS_T_A, 0, UDP);
+  expect(1, 0, 0, 1, 512);
+  query("mx50.example.com", DNS_T_MX, 0, UDP);
+  expect(0, 0, 0, 1, 512);
+  if (ctx.shed != 1) {
+    printf("%llu responses were shed, expected 1\n",
+      (unsigned long long) ctx.shed);
+    failed = 1;
+  }
+
+  if (ctx.cache.hits == 0) {
+    printf("responses were not replayed from the cache\n");
+    failed = 1;
+  }
+  return failed;
+}
@@ -0,0 +1,670 @@
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+#endif
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "lookup.h"
+#include "rrl.h"
+#include "server.h"
+#include "stralloc.h"
+#include "udp.h"
+#include "uring.h"
+
+/* A socket bound to a wildcard address learns the destination of each
+   query, so the response can be sent back from that same address. */
+
+int udp_socket(const struct addrinfo *info) {
+  struct sockaddr_in *sin = (struct sockaddr_in *) info->ai_addr;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) info->ai_addr;
+  int fd = bindsocket(info), one = 1;
+
+  if (info->ai_family == AF_INET && sin->sin_addr.s_addr == INADDR_ANY) {
+#ifdef IP_PKTINFO
+    if (setsockopt(fd, IPPROTO_IP, IP_PKTINFO, &one, sizeof one) < 0)
+      err(1, "setsockopt IP_PKTINFO");
+#endif
+  }
+
+  if (info->ai_family == AF_INET6
+        && IN6_IS_ADDR_UNSPECIFIED(&sin6->sin6_addr)) {
+#ifdef IPV6_RECVPKTINFO
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one, sizeof one) < 0)
+      err(1, "setsockopt IPV6_RECVPKTINFO");
+#endif
+  }
+  return fd;
+}
+
+#define STEER_NAME 64 /* leading bytes of the name used to pick a socket */
+#define STMT(code, k) (struct sock_filter) BPF_STMT(code, k)
+#define JUMP(code, k, jt, jf) (struct sock_filter) BPF_JUMP(code, k, jt, jf)
+
+/* Attach a classic BPF program to the SO_REUSEPORT group of fd which
+   hashes the query name, ignoring case, and uses it to choose one of
+   the first count sockets in the group. The name is walked label by
+   label in an unrolled loop; a compressed or truncated name returns an
+   out of range index so the kernel falls back to its 4-tuple hash. */
+
+void udp_steer(int fd, size_t count) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+  struct sock_filter code[23 * STEER_NAME + 7], *c = code;
+  struct sock_fprog prog = { sizeof code / sizeof *code, code };
+  uint32_t done = 23 * STEER_NAME + 3, fallback = done + 3;
+
+  /* M[0] is the hash and M[1] the bytes left in the current label. */
+  *c++ = STMT(BPF_LD | BPF_IMM, 0);
+  *c++ = STMT(BPF_ST, 0);
+  *c++ = STMT(BPF_ST, 1);
+
+  for (uint32_t i = 3, p = 12; i < done; i += 23, p++) {
+    *c++ = STMT(BPF_LD | BPF_W | BPF_LEN, 0);
+    *c++ = JUMP(BPF_JMP | BPF_JGT | BPF_K, p, 1, 0);
+    *c++ = STMT(BPF_JMP | BPF_JA, fallback - i - 3);
+    *c++ = STMT(BPF_LD | BPF_B | BPF_ABS, p);
+    *c++ = STMT(BPF_MISC | BPF_TAX, 0);
+    *c++ = STMT(BPF_LD | BPF_MEM, 1);
+    *c++ = JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 5, 0);
+
+    /* Within a label, count down and fold the byte to lower case. */
+    *c++ = STMT(BPF_ALU | BPF_SUB | BPF_K, 1);
+    *c++ = STMT(BPF_ST, 1);
+    *c++ = STMT(BPF_MISC | BPF_TXA, 0);
+    *c++ = STMT(BPF_ALU | BPF_OR | BPF_K, 0x20);
+    *c++ = STMT(BPF_JMP | BPF_JA, 6);
+
+    /* Otherwise this is a length byte, ending the name if zero. */
+    *c++ = STMT(BPF_MISC | BPF_TXA, 0);
+    *c++ = JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1);
+    *c++ = STMT(BPF_JMP | BPF_JA, done - i - 15);
+    *c++ = JUMP(BPF_JMP | BPF_JGE | BPF_K, 64, 0, 1);
+    *c++ = STMT(BPF_JMP | BPF_JA, fallback - i - 17);
+    *c++ = STMT(BPF_ST, 1);
+
+    *c++ = STMT(BPF_MISC | BPF_TAX, 0);
+    *c++ = STMT(BPF_LD | BPF_MEM, 0);
+    *c++ = STMT(BPF_ALU | BPF_MUL | BPF_K, 31);
+    *c++ = STMT(BPF_ALU | BPF_ADD | BPF_X, 0);
+    *c++ = STMT(BPF_ST, 0);
+  }
+
+  /* Longer names are distinguished by their first STEER_NAME bytes. */
+  *c++ = STMT(BPF_LD | BPF_MEM, 0);
+  *c++ = STMT(BPF_ALU | BPF_MOD | BPF_K, count);
+  *c++ = STMT(BPF_RET | BPF_A, 0);
+  *c++ = STMT(BPF_RET | BPF_K, -1);
+
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+        sizeof prog) < 0)
+    err(1, "setsockopt SO_ATTACH_REUSEPORT_CBPF");
+#else
+  errx(1, "Steering by query name is not supported on this platform");
+#endif
+}
+
+/* Discard responses, runts and queries without exactly one question in
+   the kernel. Offsets include the eight byte UDP header. */
+
+void udp_filter(int fd) {
+#ifdef SO_ATTACH_FILTER
+  struct sock_filter code[] = {
+    STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+    JUMP(BPF_JMP | BPF_JGE | BPF_K, 8 + 17, 0, 5),
+    STMT(BPF_LD | BPF_B | BPF_ABS, 8 + 2),
+    JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x80, 3, 0),
+    STMT(BPF_LD | BPF_H | BPF_ABS, 8 + 4),
+    JUMP(BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 1),
+    STMT(BPF_RET | BPF_K, -1),
+    STMT(BPF_RET | BPF_K, 0)
+  };
+  struct sock_fprog prog = { sizeof code / sizeof *code, code };
+
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof prog) < 0)
+    err(1, "setsockopt SO_ATTACH_FILTER");
+#else
+  errx(1, "Kernel filtering is not supported on this platform");
+#endif
+}
+
+/* Size the socket buffers, exceeding the system limits if privileged. */
+
+void udp_buffers(int fd, int receive, int send) {
+#ifdef SO_RCVBUFFORCE
+  if (receive && setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &receive,
+        sizeof receive) == 0)
+    receive = 0;
+  if (send && setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &send,
+        sizeof send) == 0)
+    send = 0;
+#endif
+  if (receive && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receive,
+        sizeof receive) < 0)
+    err(1, "setsockopt SO_RCVBUF");
+  if (send && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &send, sizeof send) < 0)
+    err(1, "setsockopt SO_SNDBUF");
+}
+
+/* Ask for the socket's drop count with each datagram. */
+
+void udp_overflow(int fd) {
+#ifdef SO_RXQ_OVFL
+  int one = 1;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof one) < 0)
+    err(1, "setsockopt SO_RXQ_OVFL");
+#else
+  errx(1, "Overload detection is not supported on this platform");
+#endif
+}
+
+/* Datagrams the kernel has discarded, whether rejected by the filter or
+   because the receive queue was full. */
+
+uint32_t udp_drops(int fd) {
+#ifdef SO_MEMINFO
+  uint32_t info[SK_MEMINFO_VARS];
+  socklen_t len = sizeof info;
+
+  if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, info, &len) == 0
+        && len > SK_MEMINFO_DROPS * sizeof *info)
+    return info[SK_MEMINFO_DROPS];
+#endif
+  return 0;
+}
+
+int udp_init(struct udp *u, struct lookup_ctx *lookup, size_t batch,
+    size_t payload) {
+  u->batch = batch;
+  u->payload = payload;
+  u->lookup = lookup;
+  u->buffer = malloc(batch * sizeof *u->buffer);
+  u->peer = calloc(batch, sizeof *u->peer);
+  u->control = calloc(batch, sizeof *u->control);
+  u->query = calloc(batch, sizeof *u->query);
+  if (!u->buffer || !u->peer || !u->control || !u->query)
+    return 0;
+
+#ifdef MSG_WAITFORONE
+  u->multi = batch > 1;
+  u->msg = calloc(batch, sizeof *u->msg);
+  u->iov = calloc(batch, sizeof *u->iov);
+  if (!u->msg || !u->iov)
+    return 0;
+#endif
+  return 1;
+}
+
+static void prepare(struct udp *u, size_t i, size_t len) {
+  struct sockaddr_storage *sa = u->peer + i;
+  struct lookup_query *q = u->query + i;
+
+  q->packet = (stralloc) {
+    .s = u->buffer[i],
+    .len = len,
+    .size = sizeof *u->buffer,
+    .limit = -1
+  };
+  q->max = u->payload;
+  q->shed = u->overloaded;
+
+  if (sa->ss_family == AF_INET) {
+    q->ip = &((struct sockaddr_in *) sa)->sin_addr;
+    q->iplen = 4;
+  } else if (sa->ss_family == AF_INET6) {
+    q->ip = &((struct sockaddr_in6 *) sa)->sin6_addr;
+    q->iplen = 16;
+  } else {
+    q->packet.len = 0; /* ignored by lookup */
+  }
+}
+
+int udp_limit(struct udp *u, const struct udp *share, uint32_t rate,
+    uint32_t slip) {
+  return (u->rrl = calloc(1, sizeof *u->rrl))
+    && rrl_init(u->rrl, share ? share->rrl : 0, rate, slip);
+}
+
+/* Cut a response back to its question with TC set, inviting a genuine
+   client to retry over TCP. The question name is never compressed. */
+
+static size_t slip(char *packet, size_t len) {
+  size_t pos = 12;
+
+  if (packet[4] || packet[5]) {
+    while (pos < len && packet[pos])
+      pos += (uint8_t) packet[pos] + 1;
+    if ((pos += 5) > len)
+      return 0;
+  }
+  packet[2] |= 2;
+  memset(packet + 6, 0, 6);
+  return pos;
+}
+
+/* Drop or truncate responses to clients over their rate limit. */
+
+static void police(struct udp *u, size_t count) {
+  if (!u->rrl)
+    return;
+
+  rrl_clock(u->rrl);
+  for (size_t i = 0; i < count; i++) {
+    struct lookup_query *q = u->query + i;
+
+    if (q->packet.len > 0)
+      switch (rrl_check(u->rrl, q->ip, q->iplen, q->packet.s,
+            q->packet.len)) {
+        case RRL_DROP:
+          q->packet.len = 0;
+          break;
+        case RRL_SLIP:
+          q->packet.len = slip(q->packet.s, q->packet.len);
+          break;
+      }
+  }
+}
+
+/* Note whether a datagram reports more drops on its socket than before,
+   meaning the receive queue overflowed since the last batch. The kernel
+   only attaches a count once it is non-zero. */
+
+static int dropped(struct udp *u, int fd, struct msghdr *msg) {
+#ifdef SO_RXQ_OVFL
+  struct cmsghdr *c;
+  uint32_t drops;
+  size_t i;
+
+  for (c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c))
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+      memcpy(&drops, CMSG_DATA(c), sizeof drops);
+      for (i = 0; i < u->sockets && u->socket[i].fd != fd; i++)
+        continue;
+      if (i == sizeof u->socket / sizeof *u->socket)
+        return 0;
+      if (i == u->sockets) {
+        u->socket[u->sockets].fd = fd;
+        u->socket[u->sockets++].drops = 0;
+      }
+      if (u->socket[i].drops == drops)
+        return 0;
+      u->socket[i].drops = drops;
+      return 1;
+    }
+#endif
+  return 0;
+}
+
+/* Shed load from the first batch showing new drops until the receive
+   queue is drained by a batch which is not full. */
+
+static void pressure(struct udp *u, int rising, int full) {
+  if (u->shed)
+    u->overloaded = rising || (u->overloaded && full);
+}
+
+/* Turn the packet info received with a query into the source address
+   for its response, discarding any other control messages. IPv6 packet
+   info already has the right form. */
+
+static void source(struct msghdr *msg) {
+  struct cmsghdr *c, *info = 0;
+
+  for (c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+#ifdef IP_PKTINFO
+    if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_PKTINFO) {
+      struct in_pktinfo *pi = (struct in_pktinfo *) CMSG_DATA(c);
+      pi->ipi_spec_dst = pi->ipi_addr;
+      pi->ipi_ifindex = 0;
+      info = c;
+    }
+#endif
+#ifdef IPV6_PKTINFO
+    if (c->cmsg_level == IPPROTO_IPV6 && c->cmsg_type == IPV6_PKTINFO)
+      info = c;
+#endif
+  }
+
+  if (info) {
+    msg->msg_controllen = CMSG_ALIGN(info->cmsg_len);
+    memmove(msg->msg_control, info, info->cmsg_len);
+  } else {
+    msg->msg_control = 0;
+    msg->msg_controllen = 0;
+  }
+}
+
+static void single(struct udp *u, int fd) {
+  struct iovec iov = { u->buffer[0], sizeof *u->buffer };
+  struct msghdr msg = {
+    .msg_name = u->peer,
+    .msg_namelen = sizeof *u->peer,
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = u->control[0],
+    .msg_controllen = sizeof *u->control
+  };
+  ssize_t count;
+
+  if ((count = recvmsg(fd, &msg, 0)) < 0)
+    return;
+
+  /* Shedding needs batches to tell when the backlog has cleared. */
+  dropped(u, fd, &msg);
+  prepare(u, 0, count);
+  lookup_ctx_batch(u->lookup, u->query, 1);
+  police(u, 1);
+  if (u->query->packet.len > 0) {
+    iov.iov_len = u->query->packet.len;
+    source(&msg);
+    sendmsg(fd, &msg, 0);
+  }
+}
+
+#ifdef MSG_WAITFORONE
+static int multiple(struct udp *u, int fd) {
+  size_t replies = 0;
+  int count, rising = 0;
+
+  for (size_t i = 0; i < u->batch; i++) {
+    u->iov[i].iov_base = u->buffer[i];
+    u->iov[i].iov_len = sizeof *u->buffer;
+    u->msg[i].msg_hdr = (struct msghdr) {
+      .msg_name = u->peer + i,
+      .msg_namelen = sizeof *u->peer,
+      .msg_iov = u->iov + i,
+      .msg_iovlen = 1,
+      .msg_control = u->control[i],
+      .msg_controllen = sizeof *u->control
+    };
+  }
+
+  count = recvmmsg(fd, u->msg, u->batch, MSG_DONTWAIT, 0);
+  if (count < 0)
+    return errno != ENOSYS;
+
+  for (size_t i = 0; i < (size_t) count; i++)
+    rising |= dropped(u, fd, &u->msg[i].msg_hdr);
+  pressure(u, rising, (size_t) count == u->batch);
+  for (size_t i = 0; i < (size_t) count; i++)
+    prepare(u, i, u->msg[i].msg_len);
+  lookup_ctx_batch(u->lookup, u->query, count);
+  police(u, count);
+
+  for (size_t i = 0; i < (size_t) count; i++)
+    if (u->query[i].packet.len > 0) {
+      u->iov[i].iov_len = u->query[i].packet.len;
+      source(&u->msg[i].msg_hdr);
+      u->msg[replies++] = u->msg[i];
+    }
+
+  for (size_t i = 0; i < replies; i++) {
+    count = sendmmsg(fd, u->msg + i, replies - i, 0);
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (count > 0)
+      i += count - 1; /* otherwise skip the datagram that failed */
+  }
+  return 1;
+}
+#endif
+
+void udp_receive(struct udp *u, int fd) {
+#ifdef MSG_WAITFORONE
+  if (u->multi && (u->multi = multiple(u, fd)))
+    return;
+#endif
+  single(u, fd);
+}
+
+#ifdef URING
+#define RING_BUFFERS 256 /* provided receive buffers, a power of two */
+#define RING_QUERY 4096 /* larger queries are discarded */
+
+/* The kernel receives each query into a provided buffer laid out as a
+   struct io_uring_recvmsg_out, the peer address, control messages and
+   then the payload. Completed buffers wait in the backlog until the
+   previous batch of responses has been sent, as its slots are in use. */
+
+struct udp_ring {
+  struct uring r;
+  struct io_uring_buf_ring *buffers;
+  char *pool;
+  size_t size;
+  uint16_t tail;
+
+  struct msghdr layout;
+  int fd[16];
+  size_t fdc;
+
+  struct { uint16_t id, fd; uint32_t len; } backlog[RING_BUFFERS];
+  size_t first, waiting, sending;
+  int error; /* set once a receive fails for good */
+
+  struct msghdr *msg;
+  struct iovec *iov;
+  int *sock;
+};
+
+static void provide(struct udp_ring *g, uint16_t id) {
+  struct io_uring_buf *b = g->buffers->bufs + (g->tail & (RING_BUFFERS - 1));
+
+  b->addr = (uintptr_t) (g->pool + id * g->size);
+  b->len = g->size;
+  b->bid = id;
+  __atomic_store_n(&g->buffers->tail, ++g->tail, __ATOMIC_RELEASE);
+}
+
+static void arm(struct udp_ring *g, size_t i) {
+  struct io_uring_sqe *sqe = uring_sqe(&g->r);
+
+  if (sqe) {
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = g->fd[i];
+    sqe->addr = (uintptr_t) &g->layout;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = i + 1;
+  }
+}
+
+static void complete(struct udp_ring *g, struct io_uring_cqe *cqe) {
+  size_t i;
+
+  if (cqe->user_data == 0) {
+    g->sending--;
+    return;
+  }
+  i = cqe->user_data - 1;
+
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    uint16_t id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    size_t slot = (g->first + g->waiting) % RING_BUFFERS;
+
+    if (cqe->res > 0) {
+      g->backlog[slot].id = id;
+      g->backlog[slot].fd = i;
+      g->backlog[slot].len = cqe->res;
+      g->waiting++;
+    } else {
+      provide(g, id);
+    }
+  }
+
+  /* The receive stops if the buffers run out, so arm it again, but any
+     other error would only recur. */
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    if (cqe->res >= 0 || cqe->res == -ENOBUFS)
+      arm(g, i);
+    else
+      g->error = -cqe->res;
+  }
+}
+
+static void unring(struct udp_ring *g) {
+  if (g->buffers)
+    uring_buffers_free(&g->r, 0, g->buffers, RING_BUFFERS);
+  uring_free(&g->r);
+  free(g->pool);
+  free(g->msg);
+  free(g->iov);
+  free(g->sock);
+  free(g);
+}
+
+int udp_ring(struct udp *u, const int *fd, size_t fdc) {
+  struct udp_ring *g;
+  struct io_uring_cqe *cqe;
+
+  if (fdc > sizeof g->fd / sizeof *g->fd || !(g = calloc(1, sizeof *g)))
+    return 0;
+  if (!uring_init(&g->r, RING_BUFFERS + u->batch + fdc)) {
+    free(g);
+    return 0;
+  }
+  if (!(g->buffers = uring_buffers(&g->r, 0, RING_BUFFERS)))
+    goto fail;
+
+  g->layout.msg_namelen = sizeof *u->peer;
+  g->layout.msg_controllen = sizeof *u->control;
+  g->size = sizeof(struct io_uring_recvmsg_out) + sizeof *u->peer
+    + sizeof *u->control + RING_QUERY;
+  g->pool = malloc(RING_BUFFERS * g->size);
+  g->msg = calloc(u->batch, sizeof *g->msg);
+  g->iov = calloc(u->batch, sizeof *g->iov);
+  g->sock = calloc(u->batch, sizeof *g->sock);
+  if (!g->pool || !g->msg || !g->iov || !g->sock)
+    err(1, "malloc");
+
+  for (uint16_t id = 0; id < RING_BUFFERS; id++)
+    provide(g, id);
+  for (g->fdc = 0; g->fdc < fdc; g->fdc++) {
+    g->fd[g->fdc] = fd[g->fdc];
+    arm(g, g->fdc);
+  }
+
+  /* Kernels without multishot receives reject them as they are
+     submitted, so find out now and let the caller fall back to poll(). */
+  if (uring_enter(&g->r, 0) < 0)
+    goto fail;
+  while ((cqe = uring_cqe(&g->r))) {
+    complete(g, cqe);
+    uring_seen(&g->r);
+  }
+  if (g->error)
+    goto fail;
+
+  u->ring = g;
+  return 1;
+
+fail:
+  unring(g);
+  return 0;
+}
+
+static void answer(struct udp *u) {
+  struct udp_ring *g = u->ring;
+  size_t count = 0;
+  int rising = 0;
+
+  while (g->waiting > 0 && count < u->batch) {
+    uint16_t id = g->backlog[g->first].id;
+    size_t fd = g->backlog[g->first].fd;
+    char *buffer = g->pool + id * g->size;
+    struct io_uring_recvmsg_out *out = (void *) buffer;
+    char *name = buffer + sizeof *out;
+    char *control = name + g->layout.msg_namelen;
+    char *payload = control + g->layout.msg_controllen;
+
+    if (!(out->flags & MSG_TRUNC) && out->namelen <= sizeof *u->peer) {
+      memcpy(u->peer + count, name, out->namelen);
+      memcpy(u->buffer[count], payload, out->payloadlen);
+      if (out->flags & MSG_CTRUNC)
+        out->controllen = 0;
+      memcpy(u->control[count], control, out->controllen);
+
+      g->iov[count] = (struct iovec) { u->buffer[count], 0 };
+      g->msg[count] = (struct msghdr) {
+        .msg_name = u->peer + count,
+        .msg_namelen = out->namelen,
+        .msg_iov = g->iov + count,
+        .msg_iovlen = 1,
+        .msg_control = u->control[count],
+        .msg_controllen = out->controllen
+      };
+      g->sock[count] = g->fd[fd];
+      rising |= dropped(u, g->fd[fd], g->msg + count);
+      prepare(u, count++, out->payloadlen);
+    }
+
+    provide(g, id);
+    g->first = (g->first + 1) % RING_BUFFERS;
+    g->waiting--;
+  }
+
+  pressure(u, rising, g->waiting > 0);
+  for (size_t i = 0; i < count; i++)
+    u->query[i].shed = u->overloaded;
+  lookup_ctx_batch(u->lookup, u->query, count);
+  police(u, count);
+
+  for (size_t i = 0; i < count; i++) {
+    struct io_uring_sqe *sqe;
+
+    if (u->query[i].packet.len == 0 || !(sqe = uring_sqe(&g->r)))
+      continue;
+    g->iov[i].iov_len = u->query[i].packet.len;
+    source(g->msg + i);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = g->sock[i];
+    sqe->addr = (uintptr_t) (g->msg + i);
+    sqe->len = 1;
+    sqe->user_data = 0;
+    g->sending++;
+  }
+}
+
+int udp_ring_wait(struct udp *u) {
+  struct udp_ring *g = u->ring;
+  struct io_uring_cqe *cqe;
+
+  /* One system call both submits the responses to the last batch and
+     collects their completions along with any new queries. */
+  if (uring_enter(&g->r, g->sending > 0 || g->waiting == 0) < 0)
+    return -1;
+
+  while ((cqe = uring_cqe(&g->r))) {
+    complete(g, cqe);
+    uring_seen(&g->r);
+  }
+  if (g->error) {
+    errno = g->error;
+    return -1;
+  }
+  if (g->sending == 0 && g->waiting > 0)
+    answer(u);
+  return 0;
+}
+
+#else
+
+int udp_ring(struct udp *u, const int *fd, size_t fdc) {
+  return 0;
+}
+
+int udp_ring_wait(struct udp *u) {
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
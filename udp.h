@@ -0,0 +1,67 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define UDP_CONTROL 64 /* room for packet info and a drop count */
+
+struct addrinfo;
+struct iovec;
+struct lookup_ctx;
+struct lookup_query;
+struct mmsghdr;
+struct rrl;
+struct udp_ring;
+
+struct udp {
+  size_t batch;
+  size_t payload; /* largest response to EDNS queries */
+  int multi; /* cleared if recvmmsg() turns out to be unavailable */
+  int shed; /* turn away expensive queries while falling behind */
+  int overloaded;
+  struct {
+    int fd;
+    uint32_t drops; /* last SO_RXQ_OVFL count seen */
+  } socket[16];
+  size_t sockets;
+
+  char (*buffer)[65535];
+  struct sockaddr_storage *peer;
+  char (*control)[UDP_CONTROL];
+  struct lookup_query *query;
+  struct mmsghdr *msg;
+  struct iovec *iov;
+
+  struct udp_ring *ring; /* set while io_uring is in use */
+  struct rrl *rrl; /* set if responses are rate limited */
+  struct lookup_ctx *lookup;
+};
+
+int udp_socket(const struct addrinfo *info);
+void udp_steer(int fd, size_t count);
+void udp_filter(int fd);
+void udp_buffers(int fd, int receive, int send);
+void udp_overflow(int fd);
+uint32_t udp_drops(int fd);
+int udp_init(struct udp *u, struct lookup_ctx *lookup, size_t batch,
+  size_t payload);
+
+/* udp_limit() rate limits responses, sharing the token buckets of another
+   struct udp if one is given. */
+
+int udp_limit(struct udp *u, const struct udp *share, uint32_t rate,
+  uint32_t slip);
+
+void udp_receive(struct udp *u, int fd);
+
+/* Where io_uring supports multishot receives, udp_ring() arms one on
+   each socket and returns 1; udp_ring_wait() then answers queries until
+   it is interrupted or a receive fails. Otherwise it returns 0 and
+   udp_receive() must be used instead. */
+
+int udp_ring(struct udp *u, const int *fd, size_t fdc);
+int udp_ring_wait(struct udp *u);
+
+#endif
@@ -1,99 +1,245 @@
+#define _GNU_SOURCE
 #include <err.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <netdb.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <sys/socket.h>
 
+#include "lookup.h"
+#include "rrl.h"
+#include "scan.h"
+#include "server.h"
 #include "stralloc.h"
+#include "udp.h"
 
-static struct pollfd fd[16];
-static size_t fdc;
+struct worker {
+  pthread_t thread;
+  struct pollfd fd[16];
+  size_t fdc;
+  int cpu;
 
-static char buffer[65535];
-static stralloc r = {
-  .s = buffer,
-  .size = sizeof buffer,
-  .limit = -1
+  struct udp udp;
+  struct lookup_ctx lookup;
 };
 
-void lookup(stralloc *r, size_t max, const void *ip, size_t iplen);
+static struct worker *worker;
+static size_t workers = 1;
+static size_t batch = 32, payload = RESPONSE_PAYLOAD;
+static uint32_t rate, slip = 2, rcvbuf, sndbuf;
+static int pin, filter, ring, shedding, steer;
+
+const char options[] = "b:e:ij:K:k:l:nopqr:";
+const char optionhelp[] = "\
+  -b COUNT      receive and answer up to COUNT queries per system call\n\
+  -e SIZE       answer EDNS queries with up to SIZE bytes (default 1232)\n\
+  -i            use io_uring where the kernel supports it, otherwise poll\n\
+  -j COUNT      serve queries from COUNT threads with separate sockets\n\
+  -K SIZE       set the send buffer of each socket to SIZE bytes\n\
+  -k SIZE       set the receive buffer of each socket to SIZE bytes\n\
+  -l SLIP       send every SLIP-th response over the rate limit truncated\n\
+                instead of dropping it, or none if 0 (default 2)\n\
+  -n            steer each query name to the same thread\n\
+  -o            answer expensive queries with TC while falling behind\n\
+  -p            pin each thread to a different CPU\n\
+  -q            discard datagrams which are not queries in the kernel\n\
+  -r RATE       send each client network up to RATE responses per second\n\
+                of each kind over UDP\n\
+";
+
+int configure(int option, const char *arg) {
+  uint32_t u;
+
+  switch (option) {
+    case 'b':
+      if (scan_uint32(arg, &u) != strlen(arg) || u == 0 || u > 1024)
+        errx(1, "Invalid batch size: %s", arg);
+      batch = u;
+      return 1;
+    case 'e':
+      if (scan_uint32(arg, &u) != strlen(arg) || u < 512 || u > 65535)
+        errx(1, "Invalid EDNS payload size: %s", arg);
+      payload = u;
+      return 1;
+    case 'i':
+      ring = 1;
+      return 1;
+    case 'j':
+      if (scan_uint32(arg, &u) != strlen(arg) || u == 0 || u > 1024)
+        errx(1, "Invalid thread count: %s", arg);
+      workers = u;
+      return 1;
+    case 'K':
+      if (scan_uint32(arg, &sndbuf) != strlen(arg) || sndbuf == 0
+            || sndbuf > INT_MAX)
+        errx(1, "Invalid send buffer size: %s", arg);
+      return 1;
+    case 'k':
+      if (scan_uint32(arg, &rcvbuf) != strlen(arg) || rcvbuf == 0
+            || rcvbuf > INT_MAX)
+        errx(1, "Invalid receive buffer size: %s", arg);
+      return 1;
+    case 'l':
+      if (scan_uint32(arg, &slip) != strlen(arg))
+        errx(1, "Invalid slip ratio: %s", arg);
+      return 1;
+    case 'n':
+      steer = 1;
+      return 1;
+    case 'o':
+      shedding = 1;
+      return 1;
+    case 'p':
+#ifndef CPU_SET
+      errx(1, "CPU pinning is not supported on this platform");
+#endif
+      pin = 1;
+      return 1;
+    case 'q':
+      filter = 1;
+      return 1;
+    case 'r':
+      if (scan_uint32(arg, &rate) != strlen(arg) || rate == 0
+            || rate > RRL_RATE)
+        errx(1, "Invalid response rate: %s", arg);
+      return 1;
+  }
+  return 0;
+}
 
 void attach(const char *address, const char *port) {
   struct addrinfo hints = { .ai_socktype = SOCK_DGRAM }, *info, *list;
-  int one = 1, status = getaddrinfo(address, port, &hints, &list);
+  int status = getaddrinfo(address, port, &hints, &list);
 
   if (status != 0 || list == 0)
     errx(1, "getaddrinfo %s: %s", address, gai_strerror(status));
+  if (!worker && !(worker = calloc(workers, sizeof *worker)))
+    err(1, "calloc");
+
+  /* Each worker has its own socket for every address, relying on
+     SO_REUSEPORT to share inbound queries between them. */
+  for (info = list; info; info = info->ai_next) {
+    for (struct worker *w = worker; w < worker + workers; w++) {
+      if (w->fdc >= sizeof w->fd / sizeof *w->fd)
+        errx(1, "Too many listening addresses");
+      w->fd[w->fdc].fd = udp_socket(info);
+      udp_buffers(w->fd[w->fdc].fd, rcvbuf, sndbuf);
+      if (filter)
+        udp_filter(w->fd[w->fdc].fd);
+      if (shedding)
+        udp_overflow(w->fd[w->fdc].fd);
+      w->fd[w->fdc++].events = POLLIN;
+    }
+    if (steer)
+      udp_steer(worker->fd[worker->fdc - 1].fd, workers);
+  }
+  freeaddrinfo(list);
+}
 
-  for (info = list; info; info = info->ai_next, fdc++) {
-    if (fdc >= sizeof fd / sizeof *fd)
-      errx(1, "Too many listening addresses");
-
-    fd[fdc].fd = socket(info->ai_family, info->ai_socktype, 0);
-    if (fd[fdc].fd < 0)
-      err(1, "socket");
-    if (fcntl(fd[fdc].fd, F_SETFL, O_NONBLOCK) < 0)
-      err(1, "fcntl F_SETFL O_NONBLOCK");
-
-    setsockopt(fd[fdc].fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
-#if defined SO_REUSEPORT_LB
-    setsockopt(fd[fdc].fd, SOL_SOCKET, SO_REUSEPORT_LB, &one, sizeof one);
-#elif defined SO_REUSEPORT
-    setsockopt(fd[fdc].fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one);
-#endif
+static void statistics(void) {
+  uint64_t hits = 0, misses = 0, truncated = 0, avoided = 0, dropped = 0;
+  uint64_t limited = 0, slipped = 0, shed = 0;
+
+  for (struct worker *w = worker; w < worker + workers; w++) {
+    hits += w->lookup.cache.hits;
+    misses += w->lookup.cache.misses;
+    truncated += w->lookup.response.truncated;
+    avoided += w->lookup.response.avoided;
+    shed += w->lookup.shed;
+    if (w->udp.rrl) {
+      limited += w->udp.rrl->dropped;
+      slipped += w->udp.rrl->slipped;
+    }
+    for (size_t i = 0; i < w->fdc; i++)
+      dropped += udp_drops(w->fd[i].fd);
+  }
+  fprintf(stderr, "cache-hits=%" PRIu64 " cache-misses=%" PRIu64
+    " truncated=%" PRIu64 " truncation-avoided=%" PRIu64
+    " kernel-dropped=%" PRIu64 " rate-limited=%" PRIu64
+    " slipped=%" PRIu64 " shed=%" PRIu64 "\n", hits, misses, truncated,
+    avoided, dropped, limited, slipped, shed);
+}
 
-#if defined IP_FREEBIND && defined IPV6_FREEBIND
-    if (info->ai_family == AF_INET)
-      setsockopt(fd[fdc].fd, IPPROTO_IP, IP_FREEBIND, &one, sizeof one);
-    if (info->ai_family == AF_INET6)
-      setsockopt(fd[fdc].fd, IPPROTO_IPV6, IPV6_FREEBIND, &one, sizeof one);
-#elif defined IP_BINDANY && defined IPV6_BINDANY
-    if (info->ai_family == AF_INET)
-      setsockopt(fd[fdc].fd, IPPROTO_IP, IP_BINDANY, &one, sizeof one);
-    if (info->ai_family == AF_INET6)
-      setsockopt(fd[fdc].fd, IPPROTO_IPV6, IPV6_BINDANY, &one, sizeof one);
-#elif defined SO_BINDANY
-    setsockopt(fd[fdc].fd, SOL_SOCKET, SO_BINDANY, &one, sizeof one);
-#endif
+static void *run(void *arg) {
+  struct worker *w = arg;
+  int fd[16];
 
-    if (bind(fd[fdc].fd, info->ai_addr, info->ai_addrlen) < 0)
-      err(1, "bind");
-    fd[fdc].events = POLLIN;
+#ifdef CPU_SET
+  if (pin) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof set, &set);
   }
-  freeaddrinfo(list);
-}
+#endif
+
+  for (size_t i = 0; i < w->fdc; i++)
+    fd[i] = w->fd[i].fd;
+  if (ring && udp_ring(&w->udp, fd, w->fdc))
+    while (1) {
+      if (__atomic_exchange_n(&reporting, 0, __ATOMIC_RELAXED))
+        statistics();
+      if (udp_ring_wait(&w->udp) < 0 && errno != EINTR)
+        err(1, "io_uring");
+    }
 
-void serve() {
   while (1) {
-    if (poll(fd, fdc, -1) < 0) {
+    if (__atomic_exchange_n(&reporting, 0, __ATOMIC_RELAXED))
+      statistics();
+
+    if (poll(w->fd, w->fdc, -1) < 0) {
       if (errno == EINTR)
         continue;
       err(1, "poll");
     }
 
-    for (size_t i = 0; i < fdc; i++)
-      if (fd[i].revents) {
-        struct sockaddr_storage sa;
-        socklen_t salen = sizeof sa;
-        ssize_t count;
-
-        count = recvfrom(fd[i].fd, r.s, 512, 0, (void *) &sa, &salen);
-        if (count < 0)
-          continue;
-        r.len = count;
-
-        if (sa.ss_family == AF_INET)
-          lookup(&r, 512, &((struct sockaddr_in *) &sa)->sin_addr, 4);
-        else if (sa.ss_family == AF_INET6)
-          lookup(&r, 512, &((struct sockaddr_in6 *) &sa)->sin6_addr, 16);
-        else
-          continue;
-
-        if (r.len > 0)
-          sendto(fd[i].fd, r.s, r.len, 0, (void *) &sa, salen);
-      }
+    for (size_t i = 0; i < w->fdc; i++)
+      if (w->fd[i].revents)
+        udp_receive(&w->udp, w->fd[i].fd);
+  }
+  return 0;
+}
+
+void serve() {
+  int cpu = -1;
+#ifdef CPU_SET
+  cpu_set_t set;
+
+  if (pin && sched_getaffinity(0, sizeof set, &set) < 0)
+    err(1, "sched_getaffinity");
+#endif
+
+  for (struct worker *w = worker; w < worker + workers; w++) {
+    if (!lookup_ctx_init(&w->lookup, "data.cdb"))
+      err(1, "malloc");
+    if (!lookup_ctx_cache(&w->lookup, cachesize))
+      err(1, "malloc");
+    if (!udp_init(&w->udp, &w->lookup, batch, payload))
+      err(1, "malloc");
+    if (rate && !udp_limit(&w->udp, w > worker ? &worker->udp : 0, rate,
+          slip))
+      err(1, "malloc");
+    w->udp.shed = shedding;
+
+#ifdef CPU_SET
+    /* Assign CPUs round-robin from those we are allowed to use. */
+    if (pin)
+      do
+        cpu = (cpu + 1) % CPU_SETSIZE;
+      while (!CPU_ISSET(cpu, &set));
+#endif
+    w->cpu = cpu;
   }
+
+  for (struct worker *w = worker + 1; w < worker + workers; w++)
+    if ((errno = pthread_create(&w->thread, 0, run, w)))
+      err(1, "pthread_create");
+  run(worker);
 }
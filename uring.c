@@ -0,0 +1,154 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#ifdef URING
+
+/* A minimal io_uring interface using the raw system calls, so there is
+   no dependency on liburing. Only one thread may use each ring. */
+
+int uring_init(struct uring *r, unsigned entries) {
+  struct io_uring_params p = { 0 };
+  char *sq, *cq;
+
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0)
+    return 0;
+  r->sq = r->cq = r->sqes = MAP_FAILED;
+  r->sqentries = p.sq_entries;
+
+  r->sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP && r->cqsize > r->sqsize)
+    r->sqsize = r->cqsize;
+
+  r->sq = mmap(0, r->sqsize, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq == MAP_FAILED)
+    goto fail;
+  r->cq = r->sq;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    r->cq = mmap(0, r->cqsize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq == MAP_FAILED)
+      goto fail;
+  }
+  r->sqes = mmap(0, p.sq_entries * sizeof *r->sqes, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    goto fail;
+
+  sq = r->sq;
+  cq = r->cq;
+  r->sqhead = (unsigned *) (sq + p.sq_off.head);
+  r->sqtail = (unsigned *) (sq + p.sq_off.tail);
+  r->sqarray = (unsigned *) (sq + p.sq_off.array);
+  r->sqmask = *(unsigned *) (sq + p.sq_off.ring_mask);
+  r->cqhead = (unsigned *) (cq + p.cq_off.head);
+  r->cqtail = (unsigned *) (cq + p.cq_off.tail);
+  r->cqmask = *(unsigned *) (cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+  r->tail = r->submitted = *r->sqtail;
+  return 1;
+
+fail:
+  uring_free(r);
+  return 0;
+}
+
+/* Unmap the rings and close the descriptor, which cancels any requests
+   still in flight. */
+void uring_free(struct uring *r) {
+  if (r->sqes != MAP_FAILED)
+    munmap(r->sqes, r->sqentries * sizeof *r->sqes);
+  if (r->cq != MAP_FAILED && r->cq != r->sq)
+    munmap(r->cq, r->cqsize);
+  if (r->sq != MAP_FAILED)
+    munmap(r->sq, r->sqsize);
+  close(r->fd);
+}
+
+/* Return a cleared submission entry, flushing the queue if it is full. */
+struct io_uring_sqe *uring_sqe(struct uring *r) {
+  struct io_uring_sqe *sqe;
+  unsigned head = __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE);
+
+  if (r->tail - head >= r->sqentries) {
+    if (uring_enter(r, 0) < 0)
+      return 0;
+    head = __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE);
+    if (r->tail - head >= r->sqentries)
+      return 0;
+  }
+
+  sqe = r->sqes + (r->tail & r->sqmask);
+  r->sqarray[r->tail & r->sqmask] = r->tail & r->sqmask;
+  r->tail++;
+  memset(sqe, 0, sizeof *sqe);
+  return sqe;
+}
+
+/* Submit any queued entries and wait for at least wait completions. */
+int uring_enter(struct uring *r, unsigned wait) {
+  unsigned count = r->tail - r->submitted;
+  int status;
+
+  __atomic_store_n(r->sqtail, r->tail, __ATOMIC_RELEASE);
+  if (count == 0 && wait == 0)
+    return 0;
+  status = syscall(__NR_io_uring_enter, r->fd, count, wait,
+    wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+  if (status > 0)
+    r->submitted += status;
+  return status;
+}
+
+struct io_uring_cqe *uring_cqe(struct uring *r) {
+  unsigned head = *r->cqhead;
+
+  if (head == __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE))
+    return 0;
+  return r->cqes + (head & r->cqmask);
+}
+
+void uring_seen(struct uring *r) {
+  __atomic_store_n(r->cqhead, *r->cqhead + 1, __ATOMIC_RELEASE);
+}
+
+/* Register a ring of provided buffers for the kernel to receive into. */
+struct io_uring_buf_ring *uring_buffers(struct uring *r, uint16_t group,
+    unsigned entries) {
+  struct io_uring_buf_reg reg = { .ring_entries = entries, .bgid = group };
+  size_t size = entries * sizeof(struct io_uring_buf);
+  void *ring;
+
+  ring = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+    -1, 0);
+  if (ring == MAP_FAILED)
+    return 0;
+  reg.ring_addr = (uintptr_t) ring;
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+        &reg, 1) < 0) {
+    munmap(ring, size);
+    return 0;
+  }
+  return ring;
+}
+
+/* Unregister the buffer ring first so the kernel cannot pick another
+   buffer from it, then release its memory. */
+void uring_buffers_free(struct uring *r, uint16_t group,
+    struct io_uring_buf_ring *ring, unsigned entries) {
+  struct io_uring_buf_reg reg = { .bgid = group };
+
+  syscall(__NR_io_uring_register, r->fd, IORING_UNREGISTER_PBUF_RING,
+    &reg, 1);
+  munmap(ring, entries * sizeof(struct io_uring_buf));
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef URING_H
+#define URING_H
+
+#if defined __linux__ && defined __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define URING
+#endif
+#endif
+#endif
+
+#ifdef URING
+#include <stddef.h>
+#include <stdint.h>
+
+struct uring {
+  int fd;
+  void *sq, *cq; /* mappings of the rings, which may be the same */
+  size_t sqsize, cqsize;
+  unsigned *sqhead, *sqtail, *sqarray, sqmask, sqentries;
+  unsigned *cqhead, *cqtail, cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned tail; /* next free submission slot */
+  unsigned submitted;
+};
+
+int uring_init(struct uring *r, unsigned entries);
+void uring_free(struct uring *r);
+struct io_uring_sqe *uring_sqe(struct uring *r);
+int uring_enter(struct uring *r, unsigned wait);
+struct io_uring_cqe *uring_cqe(struct uring *r);
+void uring_seen(struct uring *r);
+struct io_uring_buf_ring *uring_buffers(struct uring *r, uint16_t group,
+  unsigned entries);
+void uring_buffers_free(struct uring *r, uint16_t group,
+  struct io_uring_buf_ring *ring, unsigned entries);
+#endif
+
+#endif